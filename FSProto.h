@@ -0,0 +1,64 @@
+#ifndef __FSProto_H__
+#define __FSProto_H__
+
+// the protocol between the file system daemon (fsd) and the programs
+// using the file system it serves: the daemon listens on a Unix socket
+// named after the disk file (the name with FS_SOCKET_SUFFIX appended);
+// FS_Boot() connects to it if it's there, and from then on each call
+// is sent to the daemon as a request and answered by a reply
+
+#define FS_SOCKET_SUFFIX ".sock"
+
+// the requests on a connection are carried out one after another,
+// and each is replied to before the next is carried out; FS_Boot()
+// makes one connection per process, shared by its threads, which send
+// a request and wait for its reply one at a time
+typedef enum {
+    FS_REQ_SYNC,
+    FS_REQ_BEGIN_BATCH,
+    FS_REQ_COMMIT_BATCH,
+    FS_REQ_CACHE_STATS,    // reply: two ints (hits, misses)
+    FS_REQ_GET_STATS,      // reply: FS_Stats_t
+    FS_REQ_CHECK,          // reply: FS_Check_t
+    FS_REQ_SNAPSHOT,       // data: a file name, saved next to the disk
+    FS_REQ_SNAPSHOT_WAIT,  // arg: snapshot
+    FS_REQ_FILE_CREATE,    // data: the path
+    FS_REQ_FILE_OPEN,      // data: the path
+    FS_REQ_FILE_READ,      // arg: fd, size, offset (-1 for the file position); reply: the data
+    FS_REQ_FILE_READ_VIEW, // arg: fd, size, offset; reply: the data (read through a view)
+    FS_REQ_FILE_WRITE,     // arg: fd, offset (-1 for the file position); data: the data
+    FS_REQ_FILE_SEEK,      // arg: fd, offset
+    FS_REQ_FILE_CLOSE,     // arg: fd
+    FS_REQ_FILE_UNLINK,    // data: the path
+    FS_REQ_CREATE_MANY,    // arg: n; data: the paths (each ending with a null); reply: n ints
+    FS_REQ_UNLINK_MANY,    // arg: n; data: the paths (each ending with a null); reply: n ints
+    FS_REQ_DIR_CREATE,     // data: the path
+    FS_REQ_DIR_UNLINK,     // data: the path
+    FS_REQ_DIR_SIZE,       // data: the path
+    FS_REQ_DIR_READ,       // arg: size; data: the path; reply: the entries
+    FS_REQ_DIR_READPLUS,   // arg: count; data: the path; reply: FS_DirEntry_t's
+    FS_REQ_DIR_OPEN,       // data: the path
+    FS_REQ_DIR_NEXT,       // arg: dd; reply: the name (16 bytes) and the inode
+    FS_REQ_DIR_CLOSE,      // arg: dd
+    FS_REQS
+} FS_Request_Op_t;
+
+// each request is this header followed by 'len' bytes of data
+typedef struct {
+    int op;     // one of FS_Request_Op_t
+    int arg[3]; // the integer arguments (depending on op)
+    int len;    // the length of the data following
+} FS_Request_t;
+
+// each reply is this header followed by 'len' bytes of data
+typedef struct {
+    int ret;    // what the call returned
+    int err;    // and osErrno if it failed
+    int len;    // the length of the data following
+} FS_Reply_t;
+
+// the largest data sent with a request or a reply; larger reads and
+// writes are split
+#define FS_MAX_DATA (1 << 20)
+
+#endif // __FSProto_H__
@@ -1,18 +1,351 @@
+#define _GNU_SOURCE // for SEEK_DATA, SEEK_HOLE and fallocate()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "LibDisk.h"
 
-typedef struct sector {
-  char data[SECTOR_SIZE];
-} sector_t;
+// used to see what happened w/ disk ops (each thread has its own)
+__thread int diskErrno; 
 
-// used to see what happened w/ disk ops
-int diskErrno; 
+// used for statistics (each thread has its own)
+__thread unsigned long diskReadCalls, diskWriteCalls;
+
+// the geometry of the disk (see Disk_InitGeometry)
+int diskSectorSize = DEFAULT_SECTOR_SIZE;
+int diskTotalSectors = DEFAULT_TOTAL_SECTORS;
 
 // the disk in memory (static makes it private to the file)
-static sector_t* disk;
+static char* disk;
+#define SECTOR_AT(s) (disk + (size_t)(s) * SECTOR_SIZE)
+
+// one bit for each sector, set when the sector is written and cleared
+// when the disk image is saved to or loaded from the backstore file;
+// the bits are set atomically since different sectors may be written
+// by different threads at the same time
+static unsigned char* dirty;
+#define DIRTY_BYTES ((TOTAL_SECTORS+7)/8)
+#define IS_DIRTY(s) (dirty[(s)/8] & (0x80 >> ((s)%8)))
+
+// when the disk is mapped (see Disk_Map), 'disk' points straight at a
+// shared mapping of the backstore file, which is identified here
+static int mapped;
+static dev_t mapped_dev;
+static ino_t mapped_ino;
+
+#define DISK_BYTES ((size_t)TOTAL_SECTORS * SECTOR_SIZE)
+
+// asynchronous requests are queued and carried out by an I/O thread,
+// which is started with the first request; the completions are kept
+// until the thread that submitted them reaps them with Disk_Poll()
+typedef struct {
+  int write;       // 1 for a write request, 0 for a read
+  int sector;      // the first sector
+  int num;         // the number of sectors
+  char* buffer;    // the caller's buffer
+  int tag;         // the caller's tag for the request
+  pthread_t owner; // the thread that submitted it
+} disk_request_t;
+
+typedef struct {
+  Disk_Completion_t c;
+  pthread_t owner; // the thread that reaps it
+} disk_done_t;
+
+static disk_request_t aio_queue[DISK_QUEUE_DEPTH]; // not yet started
+static disk_done_t aio_done[DISK_QUEUE_DEPTH];     // not yet reaped (oldest first)
+static int aio_queue_head, aio_queued;
+static int aio_completed;
+static int aio_outstanding;   // submitted but not yet reaped
+static __thread int aio_mine; // the same, of this thread
+static int aio_thread_started;
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_submitted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t aio_finished = PTHREAD_COND_INITIALIZER;
+
+// a snapshot is the disk as it was when the snapshot was taken: the
+// sectors written since are copied (before they are first written)
+// into the snapshot, and the others are still shared with the disk;
+// 'snap_lock' guards the snapshots, and is held while a sector is
+// copied to or read from one
+typedef struct {
+  int used;         // whether the snapshot is taken
+  int broken;       // whether a sector couldn't be copied in time
+  int sector_size;  // the geometry of the disk taken
+  int total_sectors;
+  char** saved;     // the copy of each sector written since (or NULL)
+} snapshot_t;
+
+static snapshot_t snapshots[DISK_MAX_SNAPSHOTS];
+static int snap_count; // the snapshots taken (read without the lock)
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * disk_release
+ *
+ * Drops the current disk area, whether allocated or mapped.
+ */
+static void disk_release()
+{
+  if (disk == NULL) return;
+  if (mapped) munmap(disk, DISK_BYTES);
+  else free(disk);
+  disk = NULL;
+  mapped = 0;
+}
+
+/*
+ * disk_is_mapped_file
+ *
+ * Returns 1 if the disk is mapped from the given file, 0 otherwise.
+ */
+static int disk_is_mapped_file(char* file)
+{
+  struct stat st;
+  if (!mapped || stat(file, &st) < 0) return 0;
+  return st.st_dev == mapped_dev && st.st_ino == mapped_ino;
+}
+
+/*
+ * disk_msync
+ *
+ * Flushes 'n' sectors starting from 'sector' of the mapped disk to
+ * the backstore file; msync() wants a page aligned address.
+ */
+static int disk_msync(int sector, int n)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t start = (size_t)sector * SECTOR_SIZE;
+  size_t end = start + (size_t)n * SECTOR_SIZE;
+  start &= ~(page - 1);
+  if (msync(disk + start, end - start, MS_SYNC) < 0) {
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * sector_is_zero
+ *
+ * Returns 1 if every byte of the sector is zero, 0 otherwise.
+ */
+static int sector_is_zero(const char* sector, int size)
+{
+  const uint64_t* w = (const uint64_t*) sector;
+  for (int i = 0; i < size / 8; i++)
+    if (w[i]) return 0;
+  return 1;
+}
+
+/*
+ * write_sparse
+ *
+ * Writes the 'num' sectors (of 'size' bytes) in 'buf' to the file at
+ * offset 'off', leaving each run of zeroed sectors out as a hole in
+ * the file (holes take no room and read back as zeroes). If 'punch'
+ * is set the file may have data there already, so the holes are
+ * punched (or, where the file system can't, the zeroes written);
+ * otherwise the file must be empty there.
+ */
+static int write_sparse(int fd, const char* buf, int num, int size, off_t off, int punch)
+{
+  int i = 0;
+  while (i < num) {
+    int zero = sector_is_zero(buf + (size_t)i * size, size);
+    int n = 1;
+    while (i + n < num && sector_is_zero(buf + (size_t)(i + n) * size, size) == zero) n++;
+    const char* run = buf + (size_t)i * size;
+    size_t len = (size_t)n * size;
+    off_t at = off + (off_t)i * size;
+    i += n;
+    if (zero && !punch) continue;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (zero && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, at, len) == 0) continue;
+#endif
+    if (pwrite(fd, run, len, at) != (ssize_t)len) return -1;
+  }
+  return 0;
+}
+
+/*
+ * read_sparse
+ *
+ * Reads the first 'len' bytes of the file into 'buf', which must be
+ * zeroed already: only the parts of the file holding data are read,
+ * the holes are skipped.
+ */
+static int read_sparse(int fd, char* buf, off_t len)
+{
+  off_t pos = 0;
+  while (pos < len) {
+    off_t data = pos, hole = len;
+#ifdef SEEK_DATA
+    data = lseek(fd, pos, SEEK_DATA);
+    if (data < 0 && errno == ENXIO) return 0; // nothing but a hole left
+    if (data < 0) data = pos;                 // holes not known: read it all
+    else if ((hole = lseek(fd, data, SEEK_HOLE)) < 0 || hole > len) hole = len;
+#endif
+    while (data < hole) {
+      ssize_t n = pread(fd, buf + data, hole - data, data);
+      if (n <= 0) return -1;
+      data += n;
+    }
+    pos = hole;
+  }
+  return 0;
+}
+
+/*
+ * aio_worker
+ *
+ * The I/O thread: carries out the queued requests one at a time and
+ * posts their completions.
+ */
+static void* aio_worker(void* arg)
+{
+  pthread_mutex_lock(&aio_lock);
+  while (1) {
+    while (aio_queued == 0) pthread_cond_wait(&aio_submitted, &aio_lock);
+    disk_request_t req = aio_queue[aio_queue_head];
+    pthread_mutex_unlock(&aio_lock);
+
+    Disk_Completion_t c;
+    c.tag = req.tag;
+    c.result = req.write ? Disk_WriteSectors(req.sector, req.num, req.buffer) :
+      Disk_ReadSectors(req.sector, req.num, req.buffer);
+    c.error = c.result < 0 ? diskErrno : 0;
+
+    // the request leaves the queue only now, so that aio_drain()
+    // doesn't return while it's being carried out
+    pthread_mutex_lock(&aio_lock);
+    aio_queue_head = (aio_queue_head + 1) % DISK_QUEUE_DEPTH;
+    aio_queued--;
+    aio_done[aio_completed].c = c;
+    aio_done[aio_completed].owner = req.owner;
+    aio_completed++;
+    pthread_cond_broadcast(&aio_finished);
+  }
+  return NULL;
+}
+
+/*
+ * aio_submit
+ *
+ * Queues an asynchronous request; fails with E_QUEUE_FULL if there
+ * are already DISK_QUEUE_DEPTH requests outstanding.
+ */
+static int aio_submit(int write, int sector, int num, char* buffer, int tag)
+{
+  // quick error checks (the rest are left to the request itself)
+  if ((sector < 0) || (num < 0) || (sector + num > TOTAL_SECTORS) || (buffer == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  pthread_mutex_lock(&aio_lock);
+  if (aio_outstanding == DISK_QUEUE_DEPTH) {
+    pthread_mutex_unlock(&aio_lock);
+    diskErrno = E_QUEUE_FULL;
+    return -1;
+  }
+  if (!aio_thread_started) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, aio_worker, NULL) != 0) {
+      pthread_mutex_unlock(&aio_lock);
+      diskErrno = E_MEM_OP;
+      return -1;
+    }
+    pthread_detach(thread);
+    aio_thread_started = 1;
+  }
+  disk_request_t* req = &aio_queue[(aio_queue_head + aio_queued) % DISK_QUEUE_DEPTH];
+  req->write = write;
+  req->sector = sector;
+  req->num = num;
+  req->buffer = buffer;
+  req->tag = tag;
+  req->owner = pthread_self();
+  aio_queued++;
+  aio_outstanding++;
+  aio_mine++;
+
+  // the call is counted for the thread that made it (not the I/O thread)
+  if (write) diskWriteCalls++;
+  else diskReadCalls++;
+  pthread_cond_signal(&aio_submitted);
+  pthread_mutex_unlock(&aio_lock);
+  return 0;
+}
+
+/*
+ * aio_drain
+ *
+ * Waits until all queued requests have been carried out (their
+ * completions are still kept for Disk_Poll); used before the disk
+ * area is replaced or saved.
+ */
+static void aio_drain()
+{
+  pthread_mutex_lock(&aio_lock);
+  while (aio_queued > 0) pthread_cond_wait(&aio_finished, &aio_lock);
+  pthread_mutex_unlock(&aio_lock);
+}
+
+/*
+ * snap_copy
+ *
+ * Copies the 'num' sectors starting from 'sector' into every snapshot
+ * still sharing them with the disk, before they are written. The
+ * caller holds 'snap_lock'.
+ */
+static void snap_copy(int sector, int num)
+{
+  for (int i = 0; i < DISK_MAX_SNAPSHOTS; i++) {
+    snapshot_t* sn = &snapshots[i];
+    if (!sn->used || sn->broken) continue;
+    for (int s = sector; s < sector + num; s++) {
+      if (sn->saved[s]) continue;
+      sn->saved[s] = malloc(SECTOR_SIZE);
+      if (sn->saved[s] == NULL) { sn->broken = 1; break; }
+      memcpy(sn->saved[s], SECTOR_AT(s), SECTOR_SIZE);
+    }
+  }
+}
+
+/*
+ * snap_before_write
+ *
+ * Called before the sectors are written; nothing to do (and no lock
+ * taken) unless there are snapshots.
+ */
+static void snap_before_write(int sector, int num)
+{
+  if (__atomic_load_n(&snap_count, __ATOMIC_ACQUIRE) == 0) return;
+  pthread_mutex_lock(&snap_lock);
+  snap_copy(sector, num);
+  pthread_mutex_unlock(&snap_lock);
+}
+
+/*
+ * snap_detach
+ *
+ * Copies every sector still shared into the snapshots, before the
+ * whole disk is replaced (so they don't depend on it any more).
+ */
+static void snap_detach()
+{
+  if (__atomic_load_n(&snap_count, __ATOMIC_ACQUIRE) == 0 || disk == NULL) return;
+  pthread_mutex_lock(&snap_lock);
+  snap_copy(0, TOTAL_SECTORS);
+  pthread_mutex_unlock(&snap_lock);
+}
 
 // used for statistics
 // static int lastSector = 0;
@@ -21,19 +354,53 @@ static sector_t* disk;
 /*
  * Disk_Init
  *
- * Initializes the disk area (really just some memory for now).
+ * Initializes the disk area (really just some memory for now) with
+ * the default geometry.
  *
- * THIS FUNCTION MUST BE CALLED BEFORE ANY OTHER FUNCTION IN HERE CAN BE USED!
+ * THIS FUNCTION (OR Disk_InitGeometry) MUST BE CALLED BEFORE ANY
+ * OTHER FUNCTION IN HERE CAN BE USED!
  *
  */
 int Disk_Init()
 {
-  // create the disk image and fill every sector with zeroes
-  disk = (sector_t *) calloc(TOTAL_SECTORS, sizeof(sector_t));
+  return Disk_InitGeometry(DEFAULT_SECTOR_SIZE, DEFAULT_TOTAL_SECTORS);
+}
+
+/*
+ * Disk_InitGeometry
+ *
+ * Like Disk_Init, but the disk has 'total_sectors' sectors of
+ * 'sector_size' bytes each; the sector size must be a power of two
+ * between MIN_SECTOR_SIZE and MAX_SECTOR_SIZE.
+ */
+int Disk_InitGeometry(int sector_size, int total_sectors)
+{
+  aio_drain();
+  snap_detach();
+  // error check
+  if (sector_size < MIN_SECTOR_SIZE || sector_size > MAX_SECTOR_SIZE ||
+      (sector_size & (sector_size - 1)) != 0 || total_sectors <= 0) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  // create the disk image and fill every sector with zeroes (the old
+  // one goes first, while its geometry is still known)
+  disk_release();
+  free(dirty);
+  dirty = NULL;
+  diskSectorSize = sector_size;
+  diskTotalSectors = total_sectors;
+  disk = (char *) calloc(TOTAL_SECTORS, SECTOR_SIZE);
   if(disk == NULL) {
     diskErrno = E_MEM_OP;
     return -1;
   }
+  dirty = (unsigned char *) calloc(DIRTY_BYTES, 1);
+  if(dirty == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
   return 0;
 }
 
@@ -41,33 +408,127 @@ int Disk_Init()
  * Disk_Save
  *
  * Makes sure the current disk image gets saved to memory - this
- * will overwrite an existing file with the same name so be careful
+ * will overwrite an existing file with the same name so be careful.
+ * The file is sparse: the zeroed sectors are holes, so an image that
+ * is mostly empty takes little room, and little time to save and load.
  */
 int Disk_Save(char* file)
 {
-  FILE* diskFile;
+  aio_drain();
+  int fd;
     
   // error check
   if (file == NULL) {
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
+
+  // the mapped disk *is* the file, so it only needs to be flushed
+  // (truncating the file would pull the rug from under the mapping)
+  if (disk_is_mapped_file(file)) {
+    if (disk_msync(0, TOTAL_SECTORS) < 0) return -1;
+    memset(dirty, 0, DIRTY_BYTES);
+    return 0;
+  }
     
   // open the diskFile
-  if ((diskFile = fopen(file, "w")) == NULL) {
+  if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
     diskErrno = E_OPENING_FILE;
     return -1;
   }
     
-  // actually write the disk image to a file
-  if ((fwrite(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
-    fclose(diskFile);
+  // actually write the disk image to a file (the sectors holding
+  // data, and then the size)
+  if (write_sparse(fd, disk, TOTAL_SECTORS, SECTOR_SIZE, 0, 0) < 0 ||
+      ftruncate(fd, (off_t)DISK_BYTES) < 0) {
+    close(fd);
     diskErrno = E_WRITING_FILE;
     return -1;
   }
     
   // clean up and return
-  fclose(diskFile);
+  if (close(fd) != 0) {
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  memset(dirty, 0, DIRTY_BYTES);
+  return 0;
+}
+
+/*
+ * Disk_SaveDirty
+ *
+ * Like Disk_Save, but only the sectors written since the last save
+ * (or load) are rewritten in place; the backstore file must be the
+ * one the disk image was last saved to or loaded from. If the file
+ * doesn't exist yet or has the wrong size, the whole image is saved.
+ * The sectors are on stable storage once it returns.
+ */
+int Disk_SaveDirty(char* file)
+{
+  aio_drain();
+  int fd;
+  struct stat st;
+
+  // error check
+  if (file == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  // for the mapped disk, flush each run of consecutive dirty sectors
+  if (disk_is_mapped_file(file)) {
+    int i = 0;
+    while (i < TOTAL_SECTORS) {
+      if (dirty[i/8] == 0) { i += 8 - i%8; continue; }
+      if (!IS_DIRTY(i)) { i++; continue; }
+      int n = 1;
+      while (i + n < TOTAL_SECTORS && IS_DIRTY(i + n)) n++;
+      if (disk_msync(i, n) < 0) return -1;
+      i += n;
+    }
+    memset(dirty, 0, DIRTY_BYTES);
+    return 0;
+  }
+
+  // open the diskFile without truncating it
+  if ((fd = open(file, O_WRONLY)) < 0)
+    return Disk_Save(file);
+  if (fstat(fd, &st) < 0 || st.st_size != (off_t)DISK_BYTES) {
+    close(fd);
+    return Disk_Save(file);
+  }
+
+  // write each run of consecutive dirty sectors with a single call
+  // (the zeroed ones become holes, as in Disk_Save)
+  int i = 0;
+  while (i < TOTAL_SECTORS) {
+    if (dirty[i/8] == 0) { i += 8 - i%8; continue; }
+    if (!IS_DIRTY(i)) { i++; continue; }
+    int n = 1;
+    while (i + n < TOTAL_SECTORS && IS_DIRTY(i + n)) n++;
+    if (write_sparse(fd, SECTOR_AT(i), n, SECTOR_SIZE, (off_t)i * SECTOR_SIZE, 1) < 0) {
+      close(fd);
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+    i += n;
+  }
+
+  // make sure the sectors are on stable storage, so that the saves
+  // reach the file in the order they are made
+  if (fdatasync(fd) < 0) {
+    close(fd);
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+
+  // clean up and return
+  if (close(fd) < 0) {
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  memset(dirty, 0, DIRTY_BYTES);
   return 0;
 }
 
@@ -75,11 +536,15 @@ int Disk_Save(char* file)
  * Disk_Load
  *
  * Loads a current disk image from disk into memory - requires that
- * the disk be created first.
+ * the disk be created first. Only the parts of the file holding data
+ * are read (see Disk_Save); the holes are left as the zeroed pages of
+ * a fresh disk area, which take no memory until they're written.
  */
 int Disk_Load(char* file)
 {
-  FILE* diskFile;
+  aio_drain();
+  snap_detach();
+  int fd;
     
   // error check
   if (file == NULL) {
@@ -88,20 +553,131 @@ int Disk_Load(char* file)
   }
     
   // open the diskFile
-  if ((diskFile = fopen(file, "r")) == NULL) {
+  if ((fd = open(file, O_RDONLY)) < 0) {
     diskErrno = E_OPENING_FILE;
     return -1;
   }
+
+  // the file must be exactly the size of the disk
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size != (off_t)DISK_BYTES) {
+    close(fd);
+    diskErrno = E_READING_FILE;
+    return -1;
+  }
+
+  // load into a fresh disk area (reading into a mapped disk would
+  // also write to its file)
+  char* area = (char *) calloc(TOTAL_SECTORS, SECTOR_SIZE);
+  if(area == NULL) {
+    close(fd);
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
     
   // actually read the disk image into memory
-  if ((fread(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
-    fclose(diskFile);
+  if (read_sparse(fd, area, (off_t)DISK_BYTES) < 0) {
+    free(area);
+    close(fd);
     diskErrno = E_READING_FILE;
     return -1;
   }
     
   // clean up and return
-  fclose(diskFile);
+  close(fd);
+  disk_release();
+  disk = area;
+  memset(dirty, 0, DIRTY_BYTES);
+  return 0;
+}
+
+/*
+ * Disk_Map
+ *
+ * Like Disk_Load, but instead of reading the disk image into memory,
+ * the backstore file is mapped (shared) and used as the disk itself:
+ * sectors are paged in only when touched, and every write goes to
+ * the file (the OS may write it back at any time; Disk_Save and
+ * Disk_SaveDirty make sure it's on the file). Requires that the disk
+ * be created first. A file that can be read but not written is loaded
+ * instead (see Disk_Load), so that it can still be used; saving it
+ * fails.
+ */
+int Disk_Map(char* file)
+{
+  aio_drain();
+  snap_detach();
+  int fd;
+  struct stat st;
+
+  // error check
+  if (file == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  // open the diskFile
+  if ((fd = open(file, O_RDWR)) < 0) {
+    if (errno == EACCES || errno == EROFS || errno == EPERM) return Disk_Load(file);
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+
+  // the file must be exactly the size of the disk
+  if (fstat(fd, &st) < 0 || st.st_size != (off_t)DISK_BYTES) {
+    close(fd);
+    diskErrno = E_READING_FILE;
+    return -1;
+  }
+
+  // map the file (the mapping stays valid after closing the file)
+  void* addr = mmap(NULL, DISK_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  disk_release();
+  disk = (char *) addr;
+  mapped = 1;
+  mapped_dev = st.st_dev;
+  mapped_ino = st.st_ino;
+  memset(dirty, 0, DIRTY_BYTES);
+  return 0;
+}
+
+/*
+ * Disk_ReadHeader
+ *
+ * Reads the first 'size' bytes of the backstore file into a buffer
+ * provided by the user, without loading the disk; this is how the
+ * geometry of a disk image is found before the disk is initialized.
+ */
+int Disk_ReadHeader(char* file, char* buffer, int size)
+{
+  int fd;
+
+  // error check
+  if (file == NULL || buffer == NULL || size < 0) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  // open the diskFile
+  if ((fd = open(file, O_RDONLY)) < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+
+  // actually read the header
+  if (pread(fd, buffer, size, 0) != size) {
+    close(fd);
+    diskErrno = E_READING_FILE;
+    return -1;
+  }
+
+  // clean up and return
+  close(fd);
   return 0;
 }
 
@@ -113,6 +689,7 @@ int Disk_Load(char* file)
  */
 int Disk_Read(int sector, char* buffer)
 {
+  diskReadCalls++;
   // quick error checks
   if ((sector < 0) || (sector >= TOTAL_SECTORS) || (buffer == NULL)) {
     diskErrno = E_INVALID_PARAM;
@@ -120,7 +697,7 @@ int Disk_Read(int sector, char* buffer)
   }
     
   // copy the memory for the user
-  if((memcpy((void*)buffer, (void*)(disk + sector), sizeof(sector_t))) == NULL) {
+  if((memcpy((void*)buffer, (void*)SECTOR_AT(sector), SECTOR_SIZE)) == NULL) {
     diskErrno = E_MEM_OP;
     return -1;
   }
@@ -135,6 +712,7 @@ int Disk_Read(int sector, char* buffer)
  */
 int Disk_Write(int sector, char* buffer) 
 {
+  diskWriteCalls++;
   // quick error checks
   if((sector < 0) || (sector >= TOTAL_SECTORS) || (buffer == NULL)) {
     diskErrno = E_INVALID_PARAM;
@@ -142,9 +720,264 @@ int Disk_Write(int sector, char* buffer)
   }
     
   // copy the memory for the user
-  if((memcpy((void*)(disk + sector), (void*)buffer, sizeof(sector_t))) == NULL) {
+  snap_before_write(sector, 1);
+  if((memcpy((void*)SECTOR_AT(sector), (void*)buffer, SECTOR_SIZE)) == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  __atomic_fetch_or(&dirty[sector/8], 0x80 >> (sector%8), __ATOMIC_RELAXED);
+  return 0;
+}
+
+/*
+ * Disk_ReadSectors
+ *
+ * Reads 'num' consecutive sectors starting from 'sector' and puts
+ * them into a buffer provided by the user.
+ */
+int Disk_ReadSectors(int sector, int num, char* buffer)
+{
+  diskReadCalls++;
+  // quick error checks
+  if ((sector < 0) || (num < 0) || (sector + num > TOTAL_SECTORS) || (buffer == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  // copy the memory for the user
+  if((memcpy((void*)buffer, (void*)SECTOR_AT(sector), (size_t)num * SECTOR_SIZE)) == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Disk_WriteSectors
+ *
+ * Writes 'num' consecutive sectors starting from 'sector' from memory
+ * to "disk".
+ */
+int Disk_WriteSectors(int sector, int num, char* buffer)
+{
+  diskWriteCalls++;
+  // quick error checks
+  if ((sector < 0) || (num < 0) || (sector + num > TOTAL_SECTORS) || (buffer == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  // copy the memory for the user
+  snap_before_write(sector, num);
+  if((memcpy((void*)SECTOR_AT(sector), (void*)buffer, (size_t)num * SECTOR_SIZE)) == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  for (int i = sector; i < sector + num; i++)
+    __atomic_fetch_or(&dirty[i/8], 0x80 >> (i%8), __ATOMIC_RELAXED);
+  return 0;
+}
+
+/*
+ * Disk_View
+ *
+ * Returns a read-only pointer to 'num' consecutive sectors starting
+ * from 'sector' in the disk itself (nothing is copied), or NULL if
+ * the sectors are out of range. The pointer stays good until the disk
+ * is initialized, loaded or mapped again, and what it points to
+ * changes as the sectors are written.
+ */
+const char* Disk_View(int sector, int num)
+{
+  diskReadCalls++;
+  // quick error checks
+  if ((sector < 0) || (num < 0) || (sector + num > TOTAL_SECTORS) || (disk == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return NULL;
+  }
+  return SECTOR_AT(sector);
+}
+
+/*
+ * Disk_Snapshot
+ *
+ * Takes a snapshot of the disk and returns its number; it takes no
+ * time, since the sectors are copied only as they are written from
+ * now on. There must be no writes in progress meanwhile.
+ */
+int Disk_Snapshot()
+{
+  aio_drain();
+  pthread_mutex_lock(&snap_lock);
+  int i = 0;
+  while (i < DISK_MAX_SNAPSHOTS && snapshots[i].used) i++;
+  if (i == DISK_MAX_SNAPSHOTS || disk == NULL) {
+    pthread_mutex_unlock(&snap_lock);
+    diskErrno = disk ? E_TOO_MANY_SNAPSHOTS : E_INVALID_PARAM;
+    return -1;
+  }
+  snapshot_t* sn = &snapshots[i];
+  sn->saved = (char**) calloc(TOTAL_SECTORS, sizeof(char*));
+  if (sn->saved == NULL) {
+    pthread_mutex_unlock(&snap_lock);
     diskErrno = E_MEM_OP;
     return -1;
   }
+  sn->used = 1;
+  sn->broken = 0;
+  sn->sector_size = SECTOR_SIZE;
+  sn->total_sectors = TOTAL_SECTORS;
+  __atomic_add_fetch(&snap_count, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&snap_lock);
+  return i;
+}
+
+/*
+ * Disk_SaveSnapshot
+ *
+ * Saves the disk as it was when the snapshot was taken to a file (a
+ * sparse disk image, like Disk_Save); the disk may be written
+ * meanwhile by other threads.
+ */
+int Disk_SaveSnapshot(int snap, char* file)
+{
+  // error check
+  if (snap < 0 || snap >= DISK_MAX_SNAPSHOTS || !snapshots[snap].used || file == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  snapshot_t* sn = &snapshots[snap];
+
+  // open the diskFile
+  int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+
+  // the sectors are gathered a chunk at a time (from the snapshot or
+  // the disk), and written while the disk is free to be written again
+  int chunk = (256 << 10) / sn->sector_size;
+  if (chunk < 1) chunk = 1;
+  char* buf = malloc((size_t)chunk * sn->sector_size);
+  int ret = buf ? 0 : -1;
+  diskErrno = E_MEM_OP;
+  for (int s = 0; ret == 0 && s < sn->total_sectors; s += chunk) {
+    int n = sn->total_sectors - s < chunk ? sn->total_sectors - s : chunk;
+    pthread_mutex_lock(&snap_lock);
+    if (sn->broken) ret = -1;
+    for (int i = 0; ret == 0 && i < n; i++)
+      memcpy(buf + (size_t)i * sn->sector_size,
+	     sn->saved[s + i] ? sn->saved[s + i] : SECTOR_AT(s + i), sn->sector_size);
+    pthread_mutex_unlock(&snap_lock);
+    if (ret == 0 && write_sparse(fd, buf, n, sn->sector_size, (off_t)s * sn->sector_size, 0) < 0) {
+      diskErrno = E_WRITING_FILE;
+      ret = -1;
+    }
+  }
+  free(buf);
+  if (ret == 0 && ftruncate(fd, (off_t)sn->total_sectors * sn->sector_size) < 0) {
+    diskErrno = E_WRITING_FILE;
+    ret = -1;
+  }
+
+  // clean up and return
+  if (close(fd) != 0 && ret == 0) {
+    diskErrno = E_WRITING_FILE;
+    ret = -1;
+  }
+  return ret;
+}
+
+/*
+ * Disk_ReleaseSnapshot
+ *
+ * Drops the snapshot, along with the sectors copied into it.
+ */
+int Disk_ReleaseSnapshot(int snap)
+{
+  pthread_mutex_lock(&snap_lock);
+  if (snap < 0 || snap >= DISK_MAX_SNAPSHOTS || !snapshots[snap].used) {
+    pthread_mutex_unlock(&snap_lock);
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  snapshot_t* sn = &snapshots[snap];
+  for (int s = 0; s < sn->total_sectors; s++) free(sn->saved[s]);
+  free(sn->saved);
+  sn->saved = NULL;
+  sn->used = 0;
+  __atomic_sub_fetch(&snap_count, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&snap_lock);
   return 0;
 }
+
+/*
+ * Disk_SubmitRead
+ *
+ * Queues a read of 'num' consecutive sectors starting from 'sector'
+ * into the buffer, which must not be touched until the completion
+ * with the same tag is reaped by Disk_Poll().
+ */
+int Disk_SubmitRead(int sector, int num, char* buffer, int tag)
+{
+  return aio_submit(0, sector, num, buffer, tag);
+}
+
+/*
+ * Disk_SubmitWrite
+ *
+ * Queues a write of 'num' consecutive sectors starting from 'sector'
+ * from the buffer, which must not be touched until the completion
+ * with the same tag is reaped by Disk_Poll().
+ */
+int Disk_SubmitWrite(int sector, int num, char* buffer, int tag)
+{
+  return aio_submit(1, sector, num, buffer, tag);
+}
+
+/*
+ * aio_count_mine
+ *
+ * Returns the number of completions waiting for the calling thread;
+ * the caller holds 'aio_lock'.
+ */
+static int aio_count_mine()
+{
+  int n = 0;
+  for (int i = 0; i < aio_completed; i++)
+    if (pthread_equal(aio_done[i].owner, pthread_self())) n++;
+  return n;
+}
+
+/*
+ * Disk_Poll
+ *
+ * Reaps up to 'max' completions of the requests submitted by the
+ * calling thread into 'done' (oldest first), waiting until at least
+ * 'wait' of them are available (or all of its outstanding requests are
+ * complete); returns the number of completions reaped.
+ */
+int Disk_Poll(Disk_Completion_t* done, int max, int wait)
+{
+  if ((done == NULL && max > 0) || (max < 0)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  if (wait > max) wait = max;
+
+  pthread_mutex_lock(&aio_lock);
+  if (wait > aio_mine) wait = aio_mine;
+  while (aio_count_mine() < wait) pthread_cond_wait(&aio_finished, &aio_lock);
+  int n = 0, kept = 0;
+  for (int i = 0; i < aio_completed; i++) {
+    if (n < max && pthread_equal(aio_done[i].owner, pthread_self())) done[n++] = aio_done[i].c;
+    else aio_done[kept++] = aio_done[i];
+  }
+  aio_completed = kept;
+  aio_outstanding -= n;
+  aio_mine -= n;
+  pthread_mutex_unlock(&aio_lock);
+  return n;
+}
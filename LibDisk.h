@@ -13,9 +13,18 @@
 #ifndef __Disk_H__
 #define __Disk_H__
 
-// a few disk parameters
-#define SECTOR_SIZE 512
-#define TOTAL_SECTORS 10000 
+// a few disk parameters: the geometry of a disk is chosen when it's
+// initialized (see Disk_InitGeometry), and these are the defaults
+#define DEFAULT_SECTOR_SIZE 512
+#define DEFAULT_TOTAL_SECTORS 10000
+#define MIN_SECTOR_SIZE 512
+#define MAX_SECTOR_SIZE 65536
+
+// the geometry of the current disk
+extern int diskSectorSize;   // the number of bytes in a sector
+extern int diskTotalSectors; // the number of sectors
+#define SECTOR_SIZE diskSectorSize
+#define TOTAL_SECTORS diskTotalSectors
 
 // disk errors
 typedef enum {
@@ -24,14 +33,49 @@ typedef enum {
   E_OPENING_FILE,
   E_WRITING_FILE,
   E_READING_FILE,
+  E_QUEUE_FULL,
+  E_TOO_MANY_SNAPSHOTS,
 } Disk_Error_t;
 
-extern int diskErrno; // used to see what happened w/ disk ops
+// the completion of an asynchronous request
+typedef struct {
+  int tag;    // the tag given when the request was submitted
+  int result; // 0 if the request was successful, -1 otherwise
+  int error;  // the disk error if the request failed
+} Disk_Completion_t;
+
+// the maximum number of asynchronous requests submitted but not yet
+// reaped by Disk_Poll()
+#define DISK_QUEUE_DEPTH 64
+
+// the maximum number of snapshots of the disk taken at once (see
+// Disk_Snapshot)
+#define DISK_MAX_SNAPSHOTS 8
+
+extern __thread int diskErrno; // used to see what happened w/ disk ops (per thread)
+
+// the number of calls made by each thread to read (Disk_Read,
+// Disk_ReadSectors, Disk_View and Disk_SubmitRead) and write
+// (Disk_Write, Disk_WriteSectors and Disk_SubmitWrite)
+extern __thread unsigned long diskReadCalls, diskWriteCalls;
 
 int Disk_Init();
+int Disk_InitGeometry(int sector_size, int total_sectors);
+int Disk_ReadHeader(char* file, char* buffer, int size);
 int Disk_Save(char* file);
+int Disk_SaveDirty(char* file);
 int Disk_Load(char* file);
+int Disk_Map(char* file);
 int Disk_Write(int sector, char* buffer);
 int Disk_Read(int sector, char* buffer);
+int Disk_ReadSectors(int sector, int num, char* buffer);
+int Disk_WriteSectors(int sector, int num, char* buffer);
+const char* Disk_View(int sector, int num);
+int Disk_SubmitRead(int sector, int num, char* buffer, int tag);
+int Disk_SubmitWrite(int sector, int num, char* buffer, int tag);
+int Disk_Poll(Disk_Completion_t* done, int max, int wait);
+int Disk_Snapshot();
+int Disk_SaveSnapshot(int snap, char* file);
+int Disk_ReleaseSnapshot(int snap);
 
 #endif // __Disk_H__
@@ -2,9 +2,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "LibDisk.h"
 #include "LibFS.h"
+#include "FSProto.h"
 
 #include <math.h>
 
@@ -18,7 +26,17 @@
 void noprintf(char* str, ...) {}
 #endif
 
-// the file system partitions the disk into five parts:
+// set to 1 to map the backstore file as the disk (see Disk_Map) and 0
+// to read the whole disk image into memory when booting
+#define FS_MMAP 1
+
+#if FS_MMAP
+#define load_backstore Disk_Map
+#else
+#define load_backstore Disk_Load
+#endif
+
+// the file system partitions the disk into six parts:
 
 // 1. the superblock (one sector), which contains a magic number at
 // its first four bytes (integer)
@@ -27,6 +45,28 @@ void noprintf(char* str, ...) {}
 // the magic number chosen for our file system
 #define OS_MAGIC 0xdeadbeef
 
+// the version of the on-disk format, stored right after the magic
+// number; version 2 keeps the data blocks in extents, version 3 adds
+// the journal, version 4 records the geometry in the superblock,
+// version 5 packs the inodes into 32 bytes, and version 6 keeps the
+// data of small files in their inodes
+#define OS_VERSION 6
+
+// the geometry of the file system is chosen when it's formatted; the
+// disk is set up accordingly when the file system is booted, and all
+// the sizes below follow from it
+typedef struct _superblock {
+    int magic;         // always OS_MAGIC
+    int version;       // always OS_VERSION
+    int sector_size;   // the number of bytes in a sector (data block)
+    int total_sectors; // the number of sectors on the disk
+    int max_files;     // the number of inodes
+} superblock_t;
+
+// the number of inodes of the file system booted
+static int max_files = DEFAULT_MAX_FILES;
+#define MAX_FILES max_files
+
 // 2. the inode bitmap (one or more sectors), which indicates whether
 // the particular entry in the inode table (#4) is currently in use
 #define INODE_BITMAP_START_SECTOR 1
@@ -51,14 +91,47 @@ void noprintf(char* str, ...) {}
 // stored consecutively
 #define INODE_TABLE_START_SECTOR (SECTOR_BITMAP_START_SECTOR+SECTOR_BITMAP_SECTORS)
 
+// an extent is a run of consecutive sectors containing data blocks
+typedef struct _extent {
+    int start;  // the first sector of the run
+    int length; // the number of sectors in the run
+} extent_t;
+
+// the first extent of a file or directory is kept in its inode (so a
+// file written in one go needs nothing else); the rest, if any, go to
+// one indirect block (a sector full of extents)
+#define INODE_EXTENTS 1
+#define INDIRECT_EXTENTS ((int)(SECTOR_SIZE/sizeof(extent_t)))
+#define MAX_EXTENTS_PER_FILE (INODE_EXTENTS+INDIRECT_EXTENTS)
+
 // an inode is used to represent each file or directory; the data
 // structure supposedly contains all necessary information about the
-// corresponding file or directory
+// corresponding file or directory; it's kept small so that many
+// inodes share a sector, and a path walk or a directory listing reads
+// fewer sectors of the inode table
 typedef struct _inode {
-    int size; // the size of the file or number of directory entries
-    int type; // 0 means regular file; 1 means directory
-    int data[MAX_SECTORS_PER_FILE]; // indices to sectors containing data blocks
+    int size;     // the size of the file or number of directory entries
+    int type;     // 0 means regular file; 1 means directory
+    int blocks;   // the number of data blocks allocated
+    int nextents; // the number of extents in use (including indirect ones)
+    union {
+        struct {
+            int indirect; // the sector containing the indirect extents (0 if none)
+            int index;    // the first sector of a directory's hash index (0 if none)
+            extent_t extent[INODE_EXTENTS]; // the extents containing data blocks
+        };
+        // the data of a small file (see INODE_INLINE)
+        char data[2 * sizeof(int) + INODE_EXTENTS * sizeof(extent_t)];
+    };
 } inode_t;
+_Static_assert(sizeof(inode_t) == 32, "the inode must be 32 bytes");
+
+// a file no bigger than INLINE_DATA_SIZE has no data blocks: its data
+// is kept in the inode instead of the extents (so it's read with the
+// inode, and takes no allocation); it moves to a data block once the
+// file grows too big
+#define INLINE_DATA_SIZE ((int)sizeof(((inode_t*)0)->data))
+#define INODE_INLINE(in) ((in)->type == 0 && (in)->blocks == 0 && (in)->size > 0)
 
 // the inode structures are stored consecutively and yet they don't
 // straddle accross the sector boundaries; that is, there may be
@@ -70,9 +143,35 @@ typedef struct _inode {
 #define INODES_PER_SECTOR (SECTOR_SIZE/sizeof(inode_t))
 #define INODE_TABLE_SECTORS ((MAX_FILES+INODES_PER_SECTOR-1)/INODES_PER_SECTOR)
 
-// 5. the data blocks; all the rest sectors are reserved for data
+// 5. the journal, where the changed metadata sectors (inodes,
+// directory entries, bitmaps, etc.) are written before they go to
+// their home locations on disk; it holds one transaction at a time: a
+// header sector followed by a copy of each sector in the transaction
+#define JOURNAL_START_SECTOR (INODE_TABLE_START_SECTOR+INODE_TABLE_SECTORS)
+
+// the most sectors in one transaction, and the size of the journal
+#define JOURNAL_BLOCKS 64
+#define JOURNAL_SECTORS (1+JOURNAL_BLOCKS)
+
+// a transaction is valid only if the checksum matches its contents,
+// so a header written without all of its sectors (or the other way
+// around) is never replayed
+#define JOURNAL_MAGIC 0x6a726e6c
+
+typedef struct _journal_header {
+    uint32_t magic;    // JOURNAL_MAGIC if there's a transaction
+    uint32_t seq;      // the sequence number of the transaction
+    uint32_t count;    // the number of sectors in the transaction (0
+                       // once it's checkpointed)
+    uint32_t checksum; // of the home sectors and the contents
+    int home[JOURNAL_BLOCKS]; // where each sector of the transaction goes
+} journal_header_t;
+_Static_assert(sizeof(journal_header_t) <= MIN_SECTOR_SIZE,
+    "the journal header must fit in one sector");
+
+// 6. the data blocks; all the rest sectors are reserved for data
 // blocks for the content of files and directories
-#define DATABLOCK_START_SECTOR (INODE_TABLE_START_SECTOR+INODE_TABLE_SECTORS)
+#define DATABLOCK_START_SECTOR (JOURNAL_START_SECTOR+JOURNAL_SECTORS)
 
 // other file related definition++
 
@@ -82,8 +181,13 @@ typedef struct _inode {
 // max length of a filename is 16 bytes (including the ending null)
 #define MAX_NAME 16
 
-// max number of open files is 256
-#define MAX_OPEN_FILES 256
+// max number of open files is 4096 (the open file table is small, and
+// neither allocating a descriptor nor checking whether a file is open
+// depends on its size)
+#define MAX_OPEN_FILES 4096
+
+// max number of directories open for reading (with Dir_Open) is 256
+#define MAX_OPEN_DIRS 256
 
 // each directory entry represents a file/directory in the parent
 // directory, and consists of a file/directory name (less than 16
@@ -92,101 +196,907 @@ typedef struct _dirent {
     char fname[MAX_NAME]; // name of the file
     int inode; // inode of the file
 } dirent_t;
+_Static_assert(sizeof(dirent_t) == sizeof(FS_Dirent_t),
+    "the directory entries are read as FS_Dirent_t's");
 
 // the number of directory entries that can be contained in a sector
 #define DIRENTS_PER_SECTOR (SECTOR_SIZE/sizeof(dirent_t))
 
+// a directory with more than one sector of directory entries has a
+// hash index, which maps the names to the positions of their
+// directory entries; it's a hash table with linear probing stored in
+// consecutive sectors, each slot holding the low 16 bits of the hash
+// of the name (which is also where the probing starts) and the
+// position of the dirent plus one (0 means the slot is empty); the
+// size of the index is determined by the number of data blocks of the
+// directory, so that the index is never more than half full
+#define INDEX_SLOTS_PER_SECTOR (SECTOR_SIZE/sizeof(uint32_t))
+#define INDEX_MAX_SLOTS 65536
+
 // global errno value here
-int osErrno;
+__thread int osErrno;
 
 // the name of the disk backstore file (with which the file system is booted)
 static char bs_filename[1024];
 
+// the sector cache sits between the file system and the disk; it
+// keeps the most recently used sectors in memory (write-back); only
+// metadata sectors are ever dirty in the cache (the data blocks of
+// files are written straight to disk), and they are not written to
+// their home locations before they are committed to the journal, so a
+// clean entry is always evicted first
+#define CACHE_SECTORS 64
+_Static_assert(CACHE_SECTORS <= JOURNAL_BLOCKS,
+    "all dirty sectors in the cache must fit in one transaction");
+
+typedef struct _cache_entry {
+    int sector; // the disk sector cached here (-1 means entry not used)
+    int dirty;  // whether the cached data is newer than the disk
+    int prev;   // the more recently used entry (-1 if head)
+    int next;   // the less recently used entry (-1 if tail)
+    char* data; // the cached data (one sector)
+} cache_entry_t;
+static cache_entry_t cache[CACHE_SECTORS];
+
+// index of the cache entry holding each sector (-1 if not cached)
+static int* cache_index;
+
+// the LRU list: head is the most recently used entry
+static int cache_head, cache_tail;
+
+// used for statistics
+static int cache_hits, cache_misses;
+
+// the number of dirty entries in the cache
+static int cache_dirty;
+
+// the number of sectors the next commit writes to the cache besides
+// the dirty ones (the changed sectors of the bitmaps and the changed
+// inodes of open files); updated atomically
+static int cache_owed;
+#define CACHE_OWE(n) __atomic_fetch_add(&cache_owed, (n), __ATOMIC_RELAXED)
+
+// the operations leave this many entries clean, besides those owed,
+// for what else a commit writes (the blocks allocated for the data
+// pending), so that a commit always finds the room it needs
+#define CACHE_RESERVE (CACHE_SECTORS/8)
+
+// set while the file system is committed (under 'fs_lock' held
+// exclusively), when the room left by the operations may be used
+static int cache_committing;
+
+// once this many sectors are dirty, the operation that made them so
+// commits them (together with those of all other operations since the
+// last commit) as one transaction
+#define JOURNAL_COMMIT_DIRTY (CACHE_SECTORS/2)
+
+// while a batch is open, only once this many are (so that the cache
+// doesn't fill up with them, see cache_lookup)
+#define JOURNAL_BATCH_DIRTY (CACHE_SECTORS - CACHE_SECTORS/4)
+
+// the sequence number of the last transaction committed
+static uint32_t journal_seq;
+
+// whether the journal holds a transaction (to be replayed at the next
+// boot), which is until it's checkpointed; changed under 'fs_lock'
+// held exclusively
+static int journal_valid;
+
+// the inode bitmap and the sector bitmap are kept in memory once the
+// file system is booted; the changed sectors of a bitmap are written
+// back (through the cache) only when the file system is synchronized;
+// the sectors freed since the last commit are held (still in use in
+// memory, but not on disk) until the next commit, so that the blocks
+// of a removed file are not overwritten while the file may still be
+// there after a crash
+typedef struct _bitmap {
+    int start;       // the first disk sector of the bitmap
+    int num;         // the number of disk sectors of the bitmap
+    int nbits;       // the number of bits in use
+    int hint;        // where to start looking for an unused bit
+    uint64_t* words; // the bits
+    char* dirty;     // whether each disk sector of the bitmap changed
+    uint64_t* held;  // the bits reset since the last commit (or NULL)
+    int scanned;     // the words looked at since the last allocation
+} bitmap_t;
+static bitmap_t inode_bitmap, sector_bitmap;
+
+// the dentry cache remembers the outcome of looking up a name in a
+// directory, whether the name was found (positive entry) or not
+// (negative entry); it's a hash table where a new entry simply
+// replaces the one in its slot
+#define DCACHE_SIZE 4096 // must be a power of two
+
+typedef struct _dentry {
+    int parent; // the inode of the directory (-1 means entry not used)
+    int child;  // the inode of the file/directory (-1 means not found)
+    char fname[MAX_NAME]; // the name looked up
+} dentry_t;
+static dentry_t dcache[DCACHE_SIZE];
+
+// within a batch (between FS_BeginBatch() and FS_CommitBatch()), the
+// directory of the most recently resolved path is remembered, so that
+// the paths sharing the same parent are not walked from root
+static int batch_depth;           // the nesting level of batches (0 if none)
+static char batch_dir[MAX_PATH];  // the path of the remembered directory
+static int batch_dir_len = -1;    // the length of the path (-1 if none)
+static int batch_dir_inode;       // the inode of the remembered directory
+
+// the file system can be used by many threads at once; the locks are
+// always taken in the order they are listed here:
+// - the 'pos_lock' of an open file is held while it's read or written
+//   at its position, or the position is moved, so that the threads
+//   sharing a descriptor each move on from where the last one ended
+// - 'fs_lock' is held exclusively while the file system is booted or
+//   synchronized (or a batch begins or ends), and shared by all other
+//   calls; it protects 'batch_depth' and the backstore as a whole
+// - 'ns_lock' is held exclusively while files and directories are
+//   created or removed, and shared while paths are looked up
+// - 'inode_locks' are held exclusively while a file is written, and
+//   shared while it's read, so different files are read and written
+//   in parallel
+// - 'alloc_lock' guards the bitmaps
+// - 'fd_lock' guards the open file table
+// - 'cache_lock' guards the sector cache (and its statistics), and
+//   'dcache_lock' the dentry cache and the remembered directory
+// - 'export_lock' guards the snapshots being saved (see FS_Snapshot)
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t ns_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t* inode_locks;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+static int inode_locks_count; // the number of inode locks initialized
+
+// the statistics (see FS_GetStats); the counters are updated
+// atomically, but not in any particular order, by all threads
+static FS_Stats_t stats;
+#define STAT_ADD(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+
+// where an API call started, for its statistics
+typedef struct _op_timer {
+    struct timespec start;     // when the call started
+    unsigned long disk_reads;  // the disk reads by the thread by then
+    unsigned long disk_writes; // and the disk writes
+} op_timer_t;
+
 /* the following functions are internal helper functions */
 
-// check magic number in the superblock; return 1 if OK, and 0 if not
+// start timing an API call
+static void op_begin(op_timer_t* t)
+{
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+    t->disk_reads = diskReadCalls;
+    t->disk_writes = diskWriteCalls;
+}
+
+// add an API call to the statistics of the operation
+static void op_end(int op, op_timer_t* t)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t us = ((end.tv_sec - t->start.tv_sec) * 1000000000LL +
+        (end.tv_nsec - t->start.tv_nsec)) / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= FS_LATENCY_BUCKETS) bucket = FS_LATENCY_BUCKETS - 1;
+    STAT_ADD(op[op].calls, 1);
+    STAT_ADD(op[op].disk_reads, diskReadCalls - t->disk_reads);
+    STAT_ADD(op[op].disk_writes, diskWriteCalls - t->disk_writes);
+    STAT_ADD(op[op].latency[bucket], 1);
+}
+
+// allocate the memory of the sector cache for the geometry of the disk
+// (freeing that of the last one); return 0 if successful, -1 otherwise
+static int cache_setup()
+{
+    free(cache[0].data);
+    free(cache_index);
+    char* data = (char*)malloc((size_t)CACHE_SECTORS * SECTOR_SIZE);
+    cache_index = (int*)malloc(TOTAL_SECTORS * sizeof(int));
+    for (int i = 0; i < CACHE_SECTORS; i++)
+        cache[i].data = data ? data + (size_t)i * SECTOR_SIZE : NULL;
+    return (data && cache_index) ? 0 : -1;
+}
+
+// empty the sector cache (without writing anything back) and link all
+// entries into the LRU list
+static void cache_init()
+{
+    for (int i = 0; i < TOTAL_SECTORS; i++) cache_index[i] = -1;
+    for (int i = 0; i < CACHE_SECTORS; i++) {
+        cache[i].sector = -1;
+        cache[i].dirty = 0;
+        cache[i].prev = i - 1;
+        cache[i].next = (i + 1 < CACHE_SECTORS) ? i + 1 : -1;
+    }
+    cache_head = 0;
+    cache_tail = CACHE_SECTORS - 1;
+    cache_hits = cache_misses = 0;
+    cache_dirty = 0;
+}
+
+// mark the cache entry as dirty or clean; the caller holds 'cache_lock'
+static void cache_set_dirty(int e, int dirty)
+{
+    if (cache[e].dirty == dirty) return;
+    cache[e].dirty = dirty;
+    cache_dirty += dirty ? 1 : -1;
+}
+
+// move the cache entry to the head of the LRU list
+static void cache_touch(int e)
+{
+    if (e == cache_head) return;
+    // unlink (e is not the head, so it must have a predecessor)
+    cache[cache[e].prev].next = cache[e].next;
+    if (cache[e].next >= 0) cache[cache[e].next].prev = cache[e].prev;
+    else cache_tail = cache[e].prev;
+    // and relink as the head
+    cache[e].prev = -1;
+    cache[e].next = cache_head;
+    cache[cache_head].prev = e;
+    cache_head = e;
+}
+
+static int cache_write_back();
+
+// a read or write of a run of sectors, carried out by disk_io()
+typedef struct _disk_io {
+    int write;    // 1 for a write, 0 for a read
+    int sector;   // the first sector
+    int num;      // the number of sectors
+    char* buffer; // the data
+} disk_io_t;
+
+// carry out the 'n' disk requests in 'io' through the disk's queue,
+// so that they're all in flight at once; a request that can't be
+// queued waits for one of ours to complete first, or is carried out
+// right away if none of ours is in flight; return 0 if all of them
+// were successful, -1 otherwise
+static int disk_io(disk_io_t* io, int n)
+{
+    Disk_Completion_t done[DISK_QUEUE_DEPTH];
+    int ret = 0, inflight = 0;
+    for (int i = 0; i < n || inflight > 0; ) {
+        if (i < n) {
+            disk_io_t* r = &io[i];
+            int err = r->write ? Disk_SubmitWrite(r->sector, r->num, r->buffer, i) :
+                Disk_SubmitRead(r->sector, r->num, r->buffer, i);
+            if (err == 0) { inflight++; i++; continue; }
+            if (diskErrno != E_QUEUE_FULL || inflight == 0) {
+                err = r->write ? Disk_WriteSectors(r->sector, r->num, r->buffer) :
+                    Disk_ReadSectors(r->sector, r->num, r->buffer);
+                if (err < 0) ret = -1;
+                i++;
+                continue;
+            }
+        }
+        int got = Disk_Poll(done, DISK_QUEUE_DEPTH, i < n ? 1 : inflight);
+        for (int j = 0; j < got; j++)
+            if (done[j].result < 0) ret = -1;
+        inflight -= got;
+    }
+    return ret;
+}
+
+// return the cache entry for the given sector; if the sector is not
+// cached, the least recently used clean entry is recycled and, if
+// 'load' is set, filled from the disk; return -1 if there's disk
+// error; the caller holds 'cache_lock'
+static int cache_lookup(int sector, int load)
+{
+    if (sector < 0 || sector >= TOTAL_SECTORS) return -1;
+    int e = cache_index[sector];
+    if (e >= 0) {
+        cache_hits++;
+        cache_touch(e);
+        return e;
+    }
+    cache_misses++;
+
+    // evict the least recently used clean entry; the operations commit
+    // long before the whole cache is dirty, but if it ever is, the
+    // dirty sectors can't be written back (they may hold the changes of
+    // operations still under way, which only a commit under 'fs_lock'
+    // held exclusively makes durable), so the operation fails instead
+    e = cache_tail;
+    while (e >= 0 && cache[e].dirty) e = cache[e].prev;
+    if (e < 0) {
+        dprintf("... cache full of dirty sectors\n");
+        return -1;
+    }
+    if (cache[e].sector >= 0) {
+        cache_index[cache[e].sector] = -1;
+        cache[e].sector = -1;
+    }
+    if (load && Disk_Read(sector, cache[e].data) < 0) return -1;
+    cache[e].sector = sector;
+    cache_index[sector] = e;
+    cache_touch(e);
+    return e;
+}
+
+// read a sector through the cache (same semantics as Disk_Read)
+static int cache_read(int sector, char* buffer)
+{
+    pthread_mutex_lock(&cache_lock);
+    int e = cache_lookup(sector, 1);
+    if (e >= 0) memcpy(buffer, cache[e].data, SECTOR_SIZE);
+    pthread_mutex_unlock(&cache_lock);
+    return e < 0 ? -1 : 0;
+}
+
+// whether the sector can be made dirty: an operation can't take the
+// room left for the next commit; the caller holds 'cache_lock'
+static int cache_room(int sector)
+{
+    int e = cache_index[sector];
+    if (cache_committing || (e >= 0 && cache[e].dirty)) return 1;
+    int owed = __atomic_load_n(&cache_owed, __ATOMIC_RELAXED);
+    if (cache_dirty + owed < CACHE_SECTORS - CACHE_RESERVE) return 1;
+    dprintf("... no room left in the cache for sector %d\n", sector);
+    return 0;
+}
+
+// write a sector through the cache (same semantics as Disk_Write);
+// the whole sector is overwritten so there's no need to load it
+static int cache_write(int sector, char* buffer)
+{
+    pthread_mutex_lock(&cache_lock);
+    int e = cache_room(sector) ? cache_lookup(sector, 0) : -1;
+    if (e >= 0) {
+        memcpy(cache[e].data, buffer, SECTOR_SIZE);
+        cache_set_dirty(e, 1);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return e < 0 ? -1 : 0;
+}
+
+// write one inode back to its sector of the inode table through the
+// cache; other inodes in the same sector may be updated by other
+// threads, so only this one is overwritten; 'owed' is set for the
+// changed inode of an open file, whose room is kept (see cache_owed);
+// return 0 if successful, -1 otherwise
+static int cache_write_inode(int inode, inode_t* data, int owed)
+{
+    int sector = INODE_TABLE_START_SECTOR + inode / INODES_PER_SECTOR;
+    pthread_mutex_lock(&cache_lock);
+    int e = (owed || cache_room(sector)) ? cache_lookup(sector, 1) : -1;
+    if (e >= 0) {
+        memcpy(cache[e].data + (inode % INODES_PER_SECTOR) * sizeof(inode_t),
+            data, sizeof(inode_t));
+        cache_set_dirty(e, 1);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return e < 0 ? -1 : 0;
+}
+
+// write all dirty sectors in the cache to disk (all at once, see
+// disk_io); the caller holds 'cache_lock'; return 0 if successful, -1
+// otherwise
+static int cache_write_back()
+{
+    disk_io_t io[CACHE_SECTORS];
+    int n = 0;
+    for (int e = 0; e < CACHE_SECTORS; e++) {
+        if (cache[e].sector >= 0 && cache[e].dirty) {
+            io[n].write = 1;
+            io[n].sector = cache[e].sector;
+            io[n].num = 1;
+            io[n].buffer = cache[e].data;
+            n++;
+        }
+    }
+    if (n == 0) return 0;
+    if (disk_io(io, n) < 0) return -1;
+    for (int e = 0; e < CACHE_SECTORS; e++)
+        if (cache[e].sector >= 0) cache_set_dirty(e, 0);
+    return 0;
+}
+
+// write all dirty sectors in the cache to disk; return 0 if
+// successful, -1 otherwise
+static int cache_flush()
+{
+    pthread_mutex_lock(&cache_lock);
+    int ret = cache_write_back();
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+// read 'num' consecutive sectors starting from 'start' into 'buffer';
+// the sectors found in the cache are copied from there and the rest
+// are read from the disk in as few calls as possible (bulk data is
+// not cached, so it doesn't push metadata out of the cache); the disk
+// is read without holding the cache lock (the data blocks of a file
+// being read are not written meanwhile); return 0 if successful, -1
+// otherwise
+static int cache_read_run(int start, int num, char* buffer)
+{
+    if (start < 0 || num < 0 || start + num > TOTAL_SECTORS) return -1;
+    int i = 0;
+    pthread_mutex_lock(&cache_lock);
+    while (i < num) {
+        int e = cache_index[start + i];
+        if (e >= 0) {
+            cache_hits++;
+            memcpy(buffer + i * SECTOR_SIZE, cache[e].data, SECTOR_SIZE);
+            i++;
+            continue;
+        }
+        int j = i + 1;
+        while (j < num && cache_index[start + j] < 0) j++;
+        cache_misses += j - i;
+        pthread_mutex_unlock(&cache_lock);
+        if (Disk_ReadSectors(start + i, j - i, buffer + i * SECTOR_SIZE) < 0) return -1;
+        pthread_mutex_lock(&cache_lock);
+        i = j;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+// write 'num' consecutive sectors starting from 'start' from 'buffer'
+// straight to the disk; the copies of the sectors in the cache (if
+// any) are updated too; return 0 if successful, -1 otherwise
+static int cache_write_run(int start, int num, char* buffer)
+{
+    if (start < 0 || num < 0 || start + num > TOTAL_SECTORS) return -1;
+    pthread_mutex_lock(&cache_lock);
+    int ret = Disk_WriteSectors(start, num, buffer);
+    for (int i = 0; ret == 0 && i < num; i++) {
+        int e = cache_index[start + i];
+        if (e >= 0) {
+            memcpy(cache[e].data, buffer + i * SECTOR_SIZE, SECTOR_SIZE);
+            cache_set_dirty(e, 0);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+// check magic number and format version in the superblock; return 1
+// if OK, and 0 if not
 static int check_magic()
 {
     char buf[SECTOR_SIZE];
-    if (Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0)
+    if (cache_read(SUPERBLOCK_START_SECTOR, buf) < 0)
         return 0;
-    if (*(int*)buf == OS_MAGIC) return 1;
-    else return 0;
+    superblock_t* sb = (superblock_t*)buf;
+    if (sb->magic != OS_MAGIC) return 0;
+    if (sb->version != OS_VERSION) {
+        dprintf("... unsupported format version %d\n", sb->version);
+        return 0;
+    }
+    return 1;
+}
+
+// the bits are kept in memory in the native order (bit i is the
+// (i%64)-th least significant bit of the (i/64)-th word), while on
+// disk the bits of each byte go from the most significant one; this
+// table reverses the bits of a byte to convert between the two
+static unsigned char bit_reverse[256];
+
+// allocate the memory for a bitmap with 'num' sectors starting from
+// 'start' sector, of which the first 'nbits' bits are used; all bits
+// are reset; if 'hold' is set, the bits reset are held until the next
+// commit; return 0 if successful, -1 otherwise
+static int bitmap_setup(bitmap_t* bm, int start, int num, int nbits, int hold)
+{
+    if (!bit_reverse[1]) {
+        for (int i = 0; i < 256; i++)
+            for (int j = 0; j < 8; j++)
+                if (i & (1 << j)) bit_reverse[i] |= 0x80 >> j;
+    }
+    free(bm->words);
+    free(bm->dirty);
+    free(bm->held);
+    bm->start = start;
+    bm->num = num;
+    bm->nbits = nbits;
+    bm->hint = 0;
+    bm->words = (uint64_t*)calloc(num * SECTOR_SIZE / 8, sizeof(uint64_t));
+    bm->dirty = (char*)calloc(num, 1);
+    bm->held = hold ? (uint64_t*)calloc(num * SECTOR_SIZE / 8, sizeof(uint64_t)) : NULL;
+    if (!bm->words || !bm->dirty || (hold && !bm->held)) return -1;
+    return 0;
+}
+
+// mark the i-th disk sector of the bitmap as changed; the caller
+// holds 'alloc_lock' (or 'fs_lock' exclusively)
+static void bitmap_mark(bitmap_t* bm, int i)
+{
+    if (bm->dirty[i]) return;
+    bm->dirty[i] = 1;
+    CACHE_OWE(1);
+}
+
+// store the i-th disk sector of the bitmap in 'buf' (the bits held
+// are still set on disk)
+static void bitmap_sector(bitmap_t* bm, int i, unsigned char* buf)
+{
+    for (int j = 0; j < SECTOR_SIZE; j++) {
+        int k = i * SECTOR_SIZE + j; // the byte index in the bitmap
+        uint64_t w = bm->words[k / 8] & ~(bm->held ? bm->held[k / 8] : 0);
+        buf[j] = bit_reverse[(w >> (8 * (k % 8))) & 0xff];
+    }
+}
+
+// initialize a bitmap: all bits should be set to zero except that
+// the first 'nset' number of bits are set to one; the bitmap is
+// written straight to disk (a format isn't committed, and the bitmap
+// may not fit in the cache); return 0 if successful, -1 otherwise
+static int bitmap_init(bitmap_t* bm, int nset)
+{
+    memset(bm->words, 0, bm->num * SECTOR_SIZE);
+    for (int i = 0; i < nset; i++)
+        bm->words[i / 64] |= (uint64_t)1 << (i % 64);
+    memset(bm->dirty, 0, bm->num);
+    if (bm->held) memset(bm->held, 0, bm->num * SECTOR_SIZE);
+    bm->hint = 0;
+    unsigned char* buf = malloc((size_t)bm->num * SECTOR_SIZE);
+    if (!buf) return -1;
+    for (int i = 0; i < bm->num; i++) bitmap_sector(bm, i, buf + i * SECTOR_SIZE);
+    int ret = cache_write_run(bm->start, bm->num, (char*)buf);
+    free(buf);
+    return ret;
 }
 
-// initialize a bitmap with 'num' sectors starting from 'start'
-// sector; all bits should be set to zero except that the first
-// 'nbits' number of bits are set to one
-static void bitmap_init(int start, int num, int nbits)
+// read the 'num' sectors of a bitmap starting from 'start' into
+// 'words'; return 0 if successful, -1 otherwise
+static int bits_load(int start, int num, uint64_t* words)
 {
-    // static map for fast lookup: the type with first i bits set
-    static unsigned char BYTE10[] =
-    { 0x00, 0x80, 0xc0, 0xe0, 0xf0, 0xf8, 0xfc, 0xfe, 0xff };
     unsigned char buf[SECTOR_SIZE];
+    memset(words, 0, num * SECTOR_SIZE);
     for (int i = 0; i < num; i++) {
-        if (nbits > 0) {
-            for (int j = 0; j < SECTOR_SIZE; j++) {
-                if (nbits > 8) { buf[j] = 0xff; nbits -= 8; }
-                else { buf[j] = BYTE10[nbits]; nbits = 0; }
-            }
-        }
-        else {
-            memset(buf, 0, SECTOR_SIZE);
+        if (cache_read(start + i, (char*)buf) < 0) return -1;
+        for (int j = 0; j < SECTOR_SIZE; j++) {
+            int k = i * SECTOR_SIZE + j; // the byte index in the bitmap
+            words[k / 8] |= (uint64_t)bit_reverse[buf[j]] << (8 * (k % 8));
         }
-        if (Disk_Write(start + i, (char*)buf) < 0) break;
     }
+    return 0;
+}
+
+// load the bitmap from disk; return 0 if successful, -1 otherwise
+static int bitmap_load(bitmap_t* bm)
+{
+    if (bits_load(bm->start, bm->num, bm->words) < 0) return -1;
+    memset(bm->dirty, 0, bm->num);
+    if (bm->held) memset(bm->held, 0, bm->num * SECTOR_SIZE);
+    bm->hint = 0;
+    return 0;
 }
 
-// set the first unused bit from a bitmap of 'nbits' bits (flip the
-// first zero appeared in the bitmap to one) and return its location;
-// return -1 if the bitmap is already full (no more zeros)
-//NBITS is the number of bytes. 
-static int bitmap_first_unused(int start, int num, int nbits)
+// write the changed sectors of the bitmap to disk (through the
+// cache); return 0 if successful, -1 otherwise
+static int bitmap_flush(bitmap_t* bm)
 {
-    // static map for fast lookup: the byte with the i-th bit set
-    static unsigned char BYTE1[] =
-    { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
     unsigned char buf[SECTOR_SIZE];
-    for (int i = 0; i < num; i++) {
-        if (Disk_Read(start + i, (char*)buf) < 0) return -1;
-        for (int j = 0; j < SECTOR_SIZE; j++) {
-            if (j >= nbits) break;
-            if (buf[j] < 0xff) {
-                int k = 0;
-                while (k < 8) {
-                    if ((BYTE1[k] & buf[j]) == '\0') {
-                        buf[j] |= BYTE1[k];
-                        break;
-                    }
-                    else k++;
-                }
-                if (Disk_Write(start + i, (char*)buf) < 0) return -1;
-                else return i * SECTOR_SIZE * 8 + j * 8 + k;
+    for (int i = 0; i < bm->num; i++) {
+        if (!bm->dirty[i]) continue;
+        bitmap_sector(bm, i, buf);
+        if (cache_write(bm->start + i, (char*)buf) < 0) return -1;
+        bm->dirty[i] = 0;
+        CACHE_OWE(-1);
+    }
+    return 0;
+}
+
+// return the i-th bit of the bitmap
+static int bitmap_test(bitmap_t* bm, int ibit)
+{
+    assert(0 <= ibit && ibit < bm->nbits);
+    return (bm->words[ibit / 64] >> (ibit % 64)) & 1;
+}
+
+// set 'n' bits of the bitmap starting from the i-th bit
+static void bitmap_set(bitmap_t* bm, int ibit, int n)
+{
+    assert(0 <= ibit && ibit + n <= bm->nbits);
+    for (int i = ibit; i < ibit + n; i++) {
+        bm->words[i / 64] |= (uint64_t)1 << (i % 64);
+        bitmap_mark(bm, i / 8 / SECTOR_SIZE);
+    }
+}
+
+// reset the i-th bit of the bitmap; return 0 if successful, -1 otherwise
+static int bitmap_reset(bitmap_t* bm, int ibit)
+{
+    if (ibit < 0 || ibit >= bm->nbits) return -1;
+    pthread_mutex_lock(&alloc_lock);
+    if (bm->held) bm->held[ibit / 64] |= (uint64_t)1 << (ibit % 64);
+    else bm->words[ibit / 64] &= ~((uint64_t)1 << (ibit % 64));
+    bitmap_mark(bm, ibit / 8 / SECTOR_SIZE);
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+}
+
+// make the bits held by the bitmap available again (once they are
+// reset on disk, or when there's nothing else left); return the number
+// of bits released; the caller holds 'alloc_lock'
+static int bitmap_release(bitmap_t* bm)
+{
+    if (!bm->held) return 0;
+    int n = 0;
+    for (int w = 0; w < (bm->nbits + 63) / 64; w++) {
+        if (!bm->held[w]) continue;
+        n += __builtin_popcountll(bm->held[w]);
+        bm->words[w] &= ~bm->held[w];
+        bm->held[w] = 0;
+    }
+    return n;
+}
+
+// make the held bits available when there are no others left; that
+// can't be done while the journal holds a transaction (one whose
+// checkpoint failed), which could be replayed over the sectors reused;
+// return the number of bits released; the caller holds 'alloc_lock'
+static int bitmap_reclaim(bitmap_t* bm)
+{
+    if (journal_valid) {
+        dprintf("... held bits not released, journal not checkpointed\n");
+        return 0;
+    }
+    return bitmap_release(bm);
+}
+
+// return the location of the first unused bit of the bitmap at or
+// after the i-th bit; return -1 if there's none; the bitmap is
+// scanned one word at a time
+static int bitmap_find_unused(bitmap_t* bm, int ibit)
+{
+    int nwords = (bm->nbits + 63) / 64;
+    int w = ibit / 64;
+    if (ibit < 0 || w >= nwords) return -1;
+    uint64_t x = ~bm->words[w] & (~(uint64_t)0 << (ibit % 64));
+    bm->scanned++;
+    while (!x) {
+        if (++w == nwords) return -1;
+        x = ~bm->words[w];
+        bm->scanned++;
+    }
+    int i = w * 64 + __builtin_ctzll(x);
+    return i < bm->nbits ? i : -1;
+}
+
+// return the number of consecutive unused bits of the bitmap starting
+// from the i-th bit (but no more than 'max')
+static int bitmap_unused_run(bitmap_t* bm, int ibit, int max)
+{
+    int n = 0;
+    while (n < max && ibit + n < bm->nbits) {
+        int i = ibit + n;
+        uint64_t x = bm->words[i / 64] >> (i % 64);
+        bm->scanned++;
+        if (x) { n += __builtin_ctzll(x); break; }
+        n += 64 - i % 64;
+    }
+    if (n > bm->nbits - ibit) n = bm->nbits - ibit;
+    return n < max ? n : max;
+}
+
+// add an allocation to the statistics, with the bitmap sectors its
+// search went through; the caller holds 'alloc_lock'
+static void bitmap_account(bitmap_t* bm)
+{
+    int bytes = bm->scanned * (int)sizeof(uint64_t);
+    STAT_ADD(allocations, 1);
+    STAT_ADD(bitmap_sectors_scanned, (bytes + SECTOR_SIZE - 1) / SECTOR_SIZE);
+    bm->scanned = 0;
+}
+
+// set the first unused bit from the bitmap, looking from where the
+// last search ended and wrapping around, and return its location;
+// the held bits are used only if there's no other; return -1 if the
+// bitmap is already full (no more zeros)
+static int bitmap_first_unused(bitmap_t* bm)
+{
+    pthread_mutex_lock(&alloc_lock);
+    int i = bitmap_find_unused(bm, bm->hint);
+    if (i < 0) i = bitmap_find_unused(bm, 0);
+    if (i < 0 && bitmap_reclaim(bm) > 0) i = bitmap_find_unused(bm, 0);
+    if (i >= 0) {
+        bitmap_set(bm, i, 1);
+        bm->hint = i + 1 < bm->nbits ? i + 1 : 0;
+    }
+    bitmap_account(bm);
+    pthread_mutex_unlock(&alloc_lock);
+    return i;
+}
+
+// allocate a run of up to 'want' (but at least one) consecutive free
+// sectors, starting from sector 'goal' if it's free (so that the last
+// extent of a file can simply grow); otherwise, the first run long
+// enough (or the longest one) found from where the last search ended
+// is taken (the held sectors are used only if there's no other); the
+// number of sectors allocated is returned through 'got'; return the
+// first sector of the run, or -1 if the disk is full
+static int allocate_n(int goal, int want, int* got)
+{
+    bitmap_t* bm = &sector_bitmap;
+    int first = -1, n = 0;
+    pthread_mutex_lock(&alloc_lock);
+    if (DATABLOCK_START_SECTOR <= goal && goal < bm->nbits && !bitmap_test(bm, goal)) {
+        first = goal;
+        n = bitmap_unused_run(bm, goal, want);
+    }
+    else {
+        do {
+            int from = bm->hint, wrapped = 0;
+            while (n < want) {
+                int i = bitmap_find_unused(bm, from);
+                if (wrapped && (i < 0 || i >= bm->hint)) break;
+                if (i < 0) { wrapped = 1; from = 0; continue; }
+                int r = bitmap_unused_run(bm, i, want);
+                if (r > n) { first = i; n = r; }
+                from = i + r;
             }
+        } while (first < 0 && bitmap_reclaim(bm) > 0);
+        if (first < 0) {
+            bitmap_account(bm);
+            pthread_mutex_unlock(&alloc_lock);
+            return -1;
+        }
+    }
+    bitmap_set(bm, first, n);
+    bm->hint = first + n < bm->nbits ? first + n : 0;
+    bitmap_account(bm);
+    pthread_mutex_unlock(&alloc_lock);
+    *got = n;
+    return first;
+}
+
+// get the i-th extent of the inode (which may be in the indirect
+// block); return 0 if successful, -1 otherwise
+static int get_extent(inode_t* inode, int i, extent_t* ext)
+{
+    assert(0 <= i && i < inode->nextents);
+    if (i < INODE_EXTENTS) {
+        *ext = inode->extent[i];
+        return 0;
+    }
+    char buf[SECTOR_SIZE];
+    if (cache_read(inode->indirect, buf) < 0) return -1;
+    *ext = ((extent_t*)buf)[i - INODE_EXTENTS];
+    return 0;
+}
+
+// set the i-th extent of the inode; an extent kept in the inode is
+// updated in memory only (the caller writes back the inode), while
+// the indirect block is updated on disk; return 0 if successful, -1
+// otherwise
+static int put_extent(inode_t* inode, int i, extent_t* ext)
+{
+    assert(0 <= i && i < MAX_EXTENTS_PER_FILE);
+    if (i < INODE_EXTENTS) {
+        inode->extent[i] = *ext;
+        return 0;
+    }
+    assert(inode->indirect > 0);
+    char buf[SECTOR_SIZE];
+    if (cache_read(inode->indirect, buf) < 0) return -1;
+    ((extent_t*)buf)[i - INODE_EXTENTS] = *ext;
+    if (cache_write(inode->indirect, buf) < 0) return -1;
+    return 0;
+}
+
+// map the 'gidx'-th data block of the file or directory to the disk
+// sector containing it; the number of data blocks following in the
+// same extent (including this one) is returned through 'run' if it's
+// not NULL; return -1 if the block is not allocated or there's error
+static int map_block(inode_t* inode, int gidx, int* run)
+{
+    if (gidx < 0 || gidx >= inode->blocks) return -1;
+    char buf[SECTOR_SIZE]; // the indirect block, loaded when needed
+    for (int i = 0; i < inode->nextents; i++) {
+        extent_t* ext;
+        if (i < INODE_EXTENTS) ext = &inode->extent[i];
+        else {
+            if (i == INODE_EXTENTS && cache_read(inode->indirect, buf) < 0) return -1;
+            ext = &((extent_t*)buf)[i - INODE_EXTENTS];
         }
-        nbits -= SECTOR_SIZE;
+        if (gidx < ext->length) {
+            if (run) *run = ext->length - gidx;
+            return ext->start + gidx;
+        }
+        gidx -= ext->length;
     }
     return -1;
 }
 
-// reset the i-th bit of a bitmap with 'num' sectors starting from
-// 'start' sector; return 0 if successful, -1 otherwise
-static int bitmap_reset(int start, int num, int ibit)
+// allocate up to 'want' (but at least one) new data blocks at the end
+// of the file or directory; they are taken from one run of free
+// sectors, which extends the last extent if possible; the inode is
+// updated but not written to disk; return the number of data blocks
+// allocated, or -1 (with osErrno set) if there's error
+static int append_blocks(inode_t* inode, int want)
 {
-    // static map for fast lookup: the byte with the i-th bit reset
-    static unsigned char BYTE0[] =
-    { 0x7f, 0xbf, 0xdf, 0xef, 0xf7, 0xfb, 0xfd, 0xfe };
+    extent_t last = { 0, 0 };
+    if (inode->nextents > 0 && get_extent(inode, inode->nextents - 1, &last) < 0) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    int goal = last.length > 0 ? last.start + last.length : 0;
+    int got;
+    int first = allocate_n(goal, want, &got);
+    if (first < 0) {
+        dprintf("... error: disk is full\n");
+        osErrno = E_NO_SPACE;
+        return -1;
+    }
 
-    // load the disk sector containing the bit
-    int ibyte = ibit / 8; // the byte containing the bit
-    int i = ibyte / SECTOR_SIZE; // the sector containing the byte
-    assert(0 <= i && i < num);
-    unsigned char buf[SECTOR_SIZE];
-    if (Disk_Read(start + i, (char*)buf) < 0) return -1;
+    if (last.length > 0 && first == goal) {
+        // the last extent simply grows
+        last.length += got;
+        if (put_extent(inode, inode->nextents - 1, &last) < 0) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+    }
+    else {
+        // we need a new extent
+        int err = 0;
+        if (inode->nextents == MAX_EXTENTS_PER_FILE) {
+            dprintf("... error: file too big, no more extents for the file\n");
+            err = E_FILE_TOO_BIG;
+        }
+        else if (inode->nextents == INODE_EXTENTS && inode->indirect == 0) {
+            // the first indirect extent; allocate the indirect block
+            char buf[SECTOR_SIZE];
+            int newsec = bitmap_first_unused(&sector_bitmap);
+            memset(buf, 0, SECTOR_SIZE);
+            if (newsec < 0) err = E_NO_SPACE;
+            else if (cache_write(newsec, buf) < 0) err = E_GENERAL;
+            else {
+                inode->indirect = newsec;
+                dprintf("... new disk sector %d for indirect extents\n", newsec);
+            }
+        }
+        extent_t ext = { first, got };
+        if (!err && put_extent(inode, inode->nextents, &ext) < 0) err = E_GENERAL;
+        if (err) {
+            for (int i = 0; i < got; i++)
+                bitmap_reset(&sector_bitmap, first + i);
+            osErrno = err;
+            return -1;
+        }
+        inode->nextents++;
+    }
+    inode->blocks += got;
+    dprintf("... new disk sectors %d..%d (%d extents, %d blocks)\n",
+        first, first + got - 1, inode->nextents, inode->blocks);
+    return got;
+}
 
-    // reset the byte and write to disk
-    buf[ibyte % SECTOR_SIZE] &= BYTE0[ibit % 8];
-    if (Disk_Write(start + i, (char*)buf) < 0) return -1;
+// release all data blocks of the file or directory except the first
+// 'keep' ones (and the indirect block once it's no longer needed);
+// the inode is updated but not written to disk; return 0 if
+// successful, -1 otherwise
+static int truncate_blocks(inode_t* inode, int keep)
+{
+    if (INODE_INLINE(inode)) return 0; // no blocks, only the data in the inode
+    while (inode->blocks > keep) {
+        extent_t last;
+        if (get_extent(inode, inode->nextents - 1, &last) < 0) return -1;
+        int n = inode->blocks - keep;
+        if (n > last.length) n = last.length;
+        for (int i = last.length - n; i < last.length; i++) {
+            bitmap_reset(&sector_bitmap, last.start + i);
+            dprintf("... reclaimed data block sector %d\n", last.start + i);
+        }
+        last.length -= n;
+        inode->blocks -= n;
+        if (last.length == 0) inode->nextents--;
+        else if (put_extent(inode, inode->nextents - 1, &last) < 0) return -1;
+    }
+    if (inode->nextents <= INODE_EXTENTS && inode->indirect > 0) {
+        bitmap_reset(&sector_bitmap, inode->indirect);
+        dprintf("... reclaimed indirect block sector %d\n", inode->indirect);
+        inode->indirect = 0;
+    }
     return 0;
 }
 
@@ -216,56 +1126,294 @@ static int illegal_filename(char* name)
     return 0;
 }
 
-// return the child inode of the given file name 'fname' from the
-// parent inode; the parent inode is currently stored in the segment
-// of inode table in the cache (we cache only one disk sector for
-// this); once found, both cached_inode_sector and cached_inode_buffer
-// may be updated to point to the segment of inode table containing
-// the child inode; the function returns -1 if no such file is found;
-// it returns -2 is something else is wrong (such as parent is not
-// directory, or there's read error, etc.)
-static int find_child_inode(int parent_inode, char* fname,
-    int* cached_inode_sector, char* cached_inode_buffer)
+// empty the dentry cache
+static void dcache_init()
 {
-    int cached_start_entry = ((*cached_inode_sector) - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-    int offset = parent_inode - cached_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t* parent = (inode_t*)(cached_inode_buffer + offset * sizeof(inode_t));
-    dprintf("... load parent inode: %d (size=%d, type=%d)\n",
-        parent_inode, parent->size, parent->type);
-    if (parent->type != 1) {
-        dprintf("... parent not a directory\n");
-        return -2;
-    }
+    for (int i = 0; i < DCACHE_SIZE; i++) dcache[i].parent = -1;
+}
 
-    int nentries = parent->size; // remaining number of directory entries 
-    int idx = 0;
-    while (nentries > 0) {
-        char buf[SECTOR_SIZE]; // cached content of directory entries
-        if (Disk_Read(parent->data[idx], buf) < 0) return -2;
-        for (int i = 0; i < DIRENTS_PER_SECTOR; i++) {
-            if (i > nentries) break;
-            if (!strcmp(((dirent_t*)buf)[i].fname, fname)) {
-                // found the file/directory; update inode cache
-                int child_inode = ((dirent_t*)buf)[i].inode;
-                dprintf("... found child_inode=%d\n", child_inode);
-                int sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
-                if (sector != (*cached_inode_sector)) {
-                    *cached_inode_sector = sector;
-                    if (Disk_Read(sector, cached_inode_buffer) < 0) return -2;
-                    dprintf("... load inode table for child\n");
-                }
-                return child_inode;
-            }
-        }
-        idx++; nentries -= DIRENTS_PER_SECTOR;
+// return the slot of the dentry cache for the name in the directory
+static dentry_t* dcache_slot(int parent_inode, char* fname)
+{
+    unsigned int h = 2166136261u ^ (unsigned int)parent_inode; // FNV-1a
+    for (char* c = fname; *c; c++) h = (h ^ (unsigned char)*c) * 16777619u;
+    return &dcache[h & (DCACHE_SIZE - 1)];
+}
+
+// look up the name in the directory from the dentry cache; return 1
+// and the child inode (-1 if the name is known not to exist) through
+// 'child_inode' if it's cached, and 0 if it's not
+static int dcache_lookup(int parent_inode, char* fname, int* child_inode)
+{
+    dentry_t* d = dcache_slot(parent_inode, fname);
+    int found = 0;
+    pthread_mutex_lock(&dcache_lock);
+    if (d->parent == parent_inode && !strcmp(d->fname, fname)) {
+        *child_inode = d->child;
+        found = 1;
     }
-    dprintf("... could not find child inode\n");
-    return -1; // not found
+    pthread_mutex_unlock(&dcache_lock);
+    return found;
 }
 
-// follow the absolute path; if successful, return the inode of the
-// parent directory immediately before the last file/directory in the
+// remember that the name in the directory refers to the child inode
+// (-1 if the name doesn't exist)
+static void dcache_insert(int parent_inode, char* fname, int child_inode)
+{
+    dentry_t* d = dcache_slot(parent_inode, fname);
+    pthread_mutex_lock(&dcache_lock);
+    d->parent = parent_inode;
+    d->child = child_inode;
+    strncpy(d->fname, fname, MAX_NAME);
+    d->fname[MAX_NAME - 1] = '\0';
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// forget the name in the directory
+static void dcache_remove(int parent_inode, char* fname)
+{
+    dentry_t* d = dcache_slot(parent_inode, fname);
+    pthread_mutex_lock(&dcache_lock);
+    if (d->parent == parent_inode && !strcmp(d->fname, fname)) d->parent = -1;
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// forget all names in the directory (which is being removed; its
+// inode may be reused for a file), and the remembered directory
+static void dcache_purge(int parent_inode)
+{
+    pthread_mutex_lock(&dcache_lock);
+    for (int i = 0; i < DCACHE_SIZE; i++)
+        if (dcache[i].parent == parent_inode) dcache[i].parent = -1;
+    batch_dir_len = -1; // it may be the directory being removed
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// return the hash of the file name
+static unsigned int name_hash(char* fname)
+{
+    unsigned int h = 2166136261u; // FNV-1a
+    for (char* c = fname; *c; c++) h = (h ^ (unsigned char)*c) * 16777619u;
+    return h;
+}
+
+// return the number of sectors of the hash index of a directory with
+// 'blocks' data blocks (0 means it doesn't need an index)
+static int index_sectors(int blocks)
+{
+    if (blocks < 2) return 0;
+    int slots = 2 * blocks * DIRENTS_PER_SECTOR, n = 1;
+    while (n * INDEX_SLOTS_PER_SECTOR < slots) n *= 2;
+    if (n * INDEX_SLOTS_PER_SECTOR > INDEX_MAX_SLOTS) return 0; // too big
+    return n;
+}
+
+// read the directory entry at position 'pos' of the directory; return
+// 0 if successful, -1 otherwise
+static int read_dirent(inode_t* dir, int pos, dirent_t* dirent)
+{
+    char buf[SECTOR_SIZE];
+    int sector = map_block(dir, pos / DIRENTS_PER_SECTOR, NULL);
+    if (sector < 0 || cache_read(sector, buf) < 0) return -1;
+    *dirent = ((dirent_t*)buf)[pos % DIRENTS_PER_SECTOR];
+    return 0;
+}
+
+// read or write a slot of the hash index; return 0 if successful, -1
+// otherwise
+static int index_get(inode_t* dir, int slot, uint32_t* entry)
+{
+    char buf[SECTOR_SIZE];
+    if (cache_read(dir->index + slot / INDEX_SLOTS_PER_SECTOR, buf) < 0) return -1;
+    *entry = ((uint32_t*)buf)[slot % INDEX_SLOTS_PER_SECTOR];
+    return 0;
+}
+static int index_put(inode_t* dir, int slot, uint32_t entry)
+{
+    char buf[SECTOR_SIZE];
+    int sector = dir->index + slot / INDEX_SLOTS_PER_SECTOR;
+    if (cache_read(sector, buf) < 0) return -1;
+    ((uint32_t*)buf)[slot % INDEX_SLOTS_PER_SECTOR] = entry;
+    return cache_write(sector, buf);
+}
+
+// look up the name in the hash index of the directory; return 1 if
+// found, with its slot, the position and the content of its directory
+// entry returned through 'slot', 'pos', and 'dirent'; return 0 if not
+// found, with the empty slot where it would go returned through
+// 'slot'; return -1 if there's error
+static int index_probe(inode_t* dir, char* fname, int* slot, int* pos, dirent_t* dirent)
+{
+    int nslots = index_sectors(dir->blocks) * INDEX_SLOTS_PER_SECTOR;
+    unsigned int hash = name_hash(fname) & 0xffff;
+    for (int i = 0; i < nslots; i++) {
+        int s = (hash + i) & (nslots - 1);
+        uint32_t entry;
+        if (index_get(dir, s, &entry) < 0) return -1;
+        if (entry == 0) { *slot = s; return 0; }
+        if ((entry >> 16) != hash) continue;
+        // same hash, check the name
+        int p = (entry & 0xffff) - 1;
+        if (read_dirent(dir, p, dirent) < 0) return -1;
+        STAT_ADD(dirents_compared, 1);
+        if (!strcmp(dirent->fname, fname)) {
+            *slot = s; *pos = p;
+            return 1;
+        }
+    }
+    return -1; // the index is full, this cannot happen!
+}
+
+// empty the slot of the hash index, moving the following entries back
+// so that none of them becomes unreachable; return 0 if successful,
+// -1 otherwise
+static int index_delete(inode_t* dir, int slot)
+{
+    int nslots = index_sectors(dir->blocks) * INDEX_SLOTS_PER_SECTOR;
+    int i = slot, j = slot;
+    while (1) {
+        j = (j + 1) & (nslots - 1);
+        uint32_t entry;
+        if (index_get(dir, j, &entry) < 0) return -1;
+        if (entry == 0) break;
+        int k = (entry >> 16) & (nslots - 1); // where its probing starts
+        // the entry at j can fill the hole at i unless it's reachable
+        // from k without passing i
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+        if (index_put(dir, i, entry) < 0) return -1;
+        i = j;
+    }
+    return index_put(dir, i, 0);
+}
+
+// (re)build the hash index of the directory, after its number of data
+// blocks changed from 'old_blocks', if the size of its index changes;
+// the old index is released; if there isn't enough consecutive space
+// for the new index, the directory goes without one; the inode is
+// updated but not written to disk; return 0 if successful, -1 otherwise
+static int index_rebuild(inode_t* dir, int old_blocks)
+{
+    int n = index_sectors(dir->blocks);
+    if (dir->index > 0 && n == index_sectors(old_blocks)) return 0;
+    if (dir->index > 0) {
+        for (int i = 0; i < index_sectors(old_blocks); i++)
+            bitmap_reset(&sector_bitmap, dir->index + i);
+        dprintf("... reclaimed hash index at disk sector %d\n", dir->index);
+        dir->index = 0;
+    }
+    if (n == 0) return 0;
+
+    int got;
+    int start = allocate_n(0, n, &got);
+    if (start < 0) return 0; // disk full, go without an index
+    if (got < n) {
+        for (int i = 0; i < got; i++) bitmap_reset(&sector_bitmap, start + i);
+        return 0;
+    }
+
+    // fill the index in memory, one group of dirents at a time
+    int nslots = n * INDEX_SLOTS_PER_SECTOR;
+    uint32_t* slots = (uint32_t*)calloc(nslots, sizeof(uint32_t));
+    if (!slots) {
+        for (int i = 0; i < n; i++) bitmap_reset(&sector_bitmap, start + i);
+        return -1;
+    }
+    for (int pos = 0; pos < dir->size; pos += DIRENTS_PER_SECTOR) {
+        char buf[SECTOR_SIZE];
+        int sector = map_block(dir, pos / DIRENTS_PER_SECTOR, NULL);
+        if (sector < 0 || cache_read(sector, buf) < 0) {
+            free(slots);
+            for (int i = 0; i < n; i++) bitmap_reset(&sector_bitmap, start + i);
+            return -1;
+        }
+        for (int i = 0; i < DIRENTS_PER_SECTOR && pos + i < dir->size; i++) {
+            unsigned int hash = name_hash(((dirent_t*)buf)[i].fname) & 0xffff;
+            int s = hash & (nslots - 1);
+            while (slots[s]) s = (s + 1) & (nslots - 1);
+            slots[s] = (hash << 16) | (pos + i + 1);
+        }
+    }
+    int ret = cache_write_run(start, n, (char*)slots);
+    free(slots);
+    if (ret < 0) {
+        for (int i = 0; i < n; i++) bitmap_reset(&sector_bitmap, start + i);
+        return -1;
+    }
+    dir->index = start;
+    dprintf("... built hash index at disk sectors %d..%d\n", start, start + n - 1);
+    return 0;
+}
+
+// return the child inode of the given file name 'fname' from the
+// parent inode; the parent inode is currently stored in the segment
+// of inode table in the cache (we cache only one disk sector for
+// this); once found, both cached_inode_sector and cached_inode_buffer
+// may be updated to point to the segment of inode table containing
+// the child inode; the function returns -1 if no such file is found;
+// it returns -2 is something else is wrong (such as parent is not
+// directory, or there's read error, etc.)
+static int find_child_inode(int parent_inode, char* fname,
+    int* cached_inode_sector, char* cached_inode_buffer)
+{
+    int cached_start_entry = ((*cached_inode_sector) - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
+    int offset = parent_inode - cached_start_entry;
+    assert(0 <= offset && offset < INODES_PER_SECTOR);
+    inode_t* parent = (inode_t*)(cached_inode_buffer + offset * sizeof(inode_t));
+    dprintf("... load parent inode: %d (size=%d, type=%d)\n",
+        parent_inode, parent->size, parent->type);
+    if (parent->type != 1) {
+        dprintf("... parent not a directory\n");
+        return -2;
+    }
+
+    int child_inode = -1;
+    STAT_ADD(dirent_lookups, 1);
+    if (parent->index > 0) {
+        // look up the hash index
+        int slot, pos;
+        dirent_t dirent;
+        int found = index_probe(parent, fname, &slot, &pos, &dirent);
+        if (found < 0) return -2;
+        if (found) child_inode = dirent.inode;
+    }
+    else {
+        // scan all directory entries
+        int nentries = parent->size; // remaining number of directory entries 
+        int idx = 0;
+        while (nentries > 0 && child_inode < 0) {
+            char buf[SECTOR_SIZE]; // cached content of directory entries
+            int sector = map_block(parent, idx, NULL);
+            if (sector < 0 || cache_read(sector, buf) < 0) return -2;
+            int i;
+            for (i = 0; i < DIRENTS_PER_SECTOR && i < nentries; i++) {
+                if (!strcmp(((dirent_t*)buf)[i].fname, fname)) {
+                    child_inode = ((dirent_t*)buf)[i].inode;
+                    i++;
+                    break;
+                }
+            }
+            STAT_ADD(dirents_compared, i);
+            idx++; nentries -= DIRENTS_PER_SECTOR;
+        }
+    }
+    if (child_inode < 0) {
+        dprintf("... could not find child inode\n");
+        return -1; // not found
+    }
+
+    // found the file/directory; update inode cache
+    dprintf("... found child_inode=%d\n", child_inode);
+    int sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
+    if (sector != (*cached_inode_sector)) {
+        *cached_inode_sector = sector;
+        if (cache_read(sector, cached_inode_buffer) < 0) return -2;
+        dprintf("... load inode table for child\n");
+    }
+    return child_inode;
+}
+
+// follow the absolute path; if successful, return the inode of the
+// parent directory immediately before the last file/directory in the
 // path; for example, for '/a/b/c/d.txt', the parent is '/a/b/c' and
 // the child is 'd.txt'; the child's inode is returned through the
 // parameter 'last_inode' and its file name is returned through the
@@ -292,17 +1440,33 @@ static int follow_path(char* path, int* last_inode, char* last_fname)
     char* lpath = pathstore;
 
     int parent_inode = -1, child_inode = 0; // start from root
-    // cache the disk sector containing the root inode
-    int cached_sector = INODE_TABLE_START_SECTOR;
+    // cache the disk sector containing the parent inode (it's loaded
+    // only when a name is not found in the dentry cache)
+    int cached_sector = -1;
     char cached_buffer[SECTOR_SIZE];
-    if (Disk_Read(cached_sector, cached_buffer) < 0) return -1;
-    dprintf("... load inode table for root from disk sector %d\n", cached_sector);
+
+    // within a batch, if the path is in the directory remembered from
+    // the last path, only the last name needs to be looked up
+    char* last_slash = strrchr(path, '/');
+    int dir_len = last_slash - path, remember = 0;
+    if (batch_depth > 0 && last_slash[1] != '\0' && dir_len < MAX_PATH) {
+        pthread_mutex_lock(&dcache_lock);
+        if (dir_len == batch_dir_len && !strncmp(path, batch_dir, dir_len)) {
+            child_inode = batch_dir_inode;
+            lpath = pathstore + dir_len; // skip to the last name
+            dprintf("... start from remembered directory inode %d\n", child_inode);
+        }
+        else remember = 1; // remember this path's directory instead
+        pthread_mutex_unlock(&dcache_lock);
+    }
 
     // for each file/directory name separated by '/'
     char* token;
+    STAT_ADD(path_lookups, 1);
     while ((token = strsep(&lpath, "/")) != NULL) {
         dprintf("... process token: '%s'\n", token);
         if (*token == '\0') continue; // multiple '/' ignored
+        STAT_ADD(path_components, 1);
         if (illegal_filename(token)) {
             dprintf("... illegal file name: '%s'\n", token);
             return -1;
@@ -315,8 +1479,22 @@ static int follow_path(char* path, int* last_inode, char* last_fname)
             return -1;
         }
         parent_inode = child_inode;
-        child_inode = find_child_inode(parent_inode, token,
-            &cached_sector, cached_buffer);
+        if (dcache_lookup(parent_inode, token, &child_inode)) {
+            dprintf("... found child_inode=%d in dentry cache\n", child_inode);
+            STAT_ADD(dcache_hits, 1);
+        }
+        else {
+            int sector = INODE_TABLE_START_SECTOR + parent_inode / INODES_PER_SECTOR;
+            if (sector != cached_sector) {
+                if (cache_read(sector, cached_buffer) < 0) return -1;
+                cached_sector = sector;
+                dprintf("... load inode table for parent from disk sector %d\n", sector);
+            }
+            child_inode = find_child_inode(parent_inode, token,
+                &cached_sector, cached_buffer);
+            // remember the outcome unless there was an error
+            if (child_inode >= -1) dcache_insert(parent_inode, token, child_inode);
+        }
         if (last_fname) strcpy(last_fname, token);
     }
     if (child_inode < -1) return -1; // if there was error, abort
@@ -327,6 +1505,14 @@ static int follow_path(char* path, int* last_inode, char* last_fname)
         // 3) '/valid-dirs.../last-valid-dir/found: parent=last-valid-dir, child=found
         // in the first case, we set parent=child=0 as special case
         if (parent_inode == -1 && child_inode == 0) parent_inode = 0;
+        else if (remember) {
+            // remember the directory for the next path in the batch
+            pthread_mutex_lock(&dcache_lock);
+            memcpy(batch_dir, path, dir_len);
+            batch_dir_len = dir_len;
+            batch_dir_inode = parent_inode;
+            pthread_mutex_unlock(&dcache_lock);
+        }
         dprintf("... found parent_inode=%d, child_inode=%d\n", parent_inode, child_inode);
         *last_inode = child_inode;
         return parent_inode;
@@ -337,8 +1523,11 @@ static int follow_path(char* path, int* last_inode, char* last_fname)
 // 'file' under parent directory represented by 'parent_inode'
 int add_inode(int type, int parent_inode, char* file)
 {
+    // the name is no longer known not to exist
+    dcache_remove(parent_inode, file);
+
     // get a new inode for child
-    int child_inode = bitmap_first_unused(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, INODE_BITMAP_SIZE);
+    int child_inode = bitmap_first_unused(&inode_bitmap);
     if (child_inode < 0) {
         dprintf("... error: inode table is full\n");
         return -1;
@@ -348,7 +1537,7 @@ int add_inode(int type, int parent_inode, char* file)
     // load the disk sector containing the child inode
     int inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
     char inode_buffer[SECTOR_SIZE];
-    if (Disk_Read(inode_sector, inode_buffer) < 0) return -1;
+    if (cache_read(inode_sector, inode_buffer) < 0) return -1;
     dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
 
     // get the child inode
@@ -360,13 +1549,13 @@ int add_inode(int type, int parent_inode, char* file)
     // update the new child inode and write to disk
     memset(child, 0, sizeof(inode_t));
     child->type = type;
-    if (Disk_Write(inode_sector, inode_buffer) < 0) return -1;
+    if (cache_write_inode(child_inode, child, 0) < 0) return -1;
     dprintf("... update child inode %d (size=%d, type=%d), update disk sector %d\n",
         child_inode, child->size, child->type, inode_sector);
 
     // get the disk sector containing the parent inode
     inode_sector = INODE_TABLE_START_SECTOR + parent_inode / INODES_PER_SECTOR;
-    if (Disk_Read(inode_sector, inode_buffer) < 0) return -1;
+    if (cache_read(inode_sector, inode_buffer) < 0) return -1;
     dprintf("... load inode table for parent inode %d from disk sector %d\n",
         parent_inode, inode_sector);
 
@@ -384,22 +1573,24 @@ int add_inode(int type, int parent_inode, char* file)
         return -2; // parent not directory
     }
     int group = parent->size / DIRENTS_PER_SECTOR;
+    int old_blocks = parent->blocks;
     char dirent_buffer[SECTOR_SIZE];
+    int dirent_sector;
     if (group * DIRENTS_PER_SECTOR == parent->size) {
         // new disk sector is needed
-        int newsec = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-        if (newsec < 0) {
-            dprintf("... error: disk is full\n");
+        if (append_blocks(parent, 1) < 0) {
+            dprintf("... error: no more data blocks for the directory\n");
             return -1;
         }
-        parent->data[group] = newsec;
+        dirent_sector = map_block(parent, group, NULL);
         memset(dirent_buffer, 0, SECTOR_SIZE);
-        dprintf("... new disk sector %d for dirent group %d\n", newsec, group);
+        dprintf("... new disk sector %d for dirent group %d\n", dirent_sector, group);
     }
     else {
-        if (Disk_Read(parent->data[group], dirent_buffer) < 0)
+        dirent_sector = map_block(parent, group, NULL);
+        if (dirent_sector < 0 || cache_read(dirent_sector, dirent_buffer) < 0)
             return -1;
-        dprintf("... load disk sector %d for dirent group %d\n", parent->data[group], group);
+        dprintf("... load disk sector %d for dirent group %d\n", dirent_sector, group);
     }
 
     // add the dirent and write to disk
@@ -408,15 +1599,27 @@ int add_inode(int type, int parent_inode, char* file)
     dirent_t* dirent = (dirent_t*)(dirent_buffer + offset * sizeof(dirent_t));
     strncpy(dirent->fname, file, MAX_NAME);
     dirent->inode = child_inode;
-    if (Disk_Write(parent->data[group], dirent_buffer) < 0) return -1;
+    if (cache_write(dirent_sector, dirent_buffer) < 0) return -1;
     dprintf("... append dirent %d (name='%s', inode=%d) to group %d, update disk sector %d\n",
-        parent->size, dirent->fname, dirent->inode, group, parent->data[group]);
+        parent->size, dirent->fname, dirent->inode, group, dirent_sector);
 
-    // update parent inode and write to disk
+    // update the hash index: it's rebuilt when it changes size (or is
+    // missing), otherwise the new entry is added
     parent->size++;
-    if (Disk_Write(inode_sector, inode_buffer) < 0) return -1;
+    if (parent->index > 0 && index_sectors(parent->blocks) == index_sectors(old_blocks)) {
+        int slot, pos;
+        dirent_t found;
+        if (index_probe(parent, file, &slot, &pos, &found) != 0) return -1;
+        unsigned int hash = name_hash(file) & 0xffff;
+        if (index_put(parent, slot, (hash << 16) | parent->size) < 0) return -1;
+    }
+    else if (index_rebuild(parent, old_blocks) < 0) return -1;
+
+    // update parent inode and write to disk
+    if (cache_write_inode(parent_inode, parent, 0) < 0) return -1;
     dprintf("... update parent inode on disk sector %d\n", inode_sector);
 
+    dcache_insert(parent_inode, file, child_inode);
     return 0;
 }
 
@@ -455,12 +1658,12 @@ int create_file_or_directory(int type, char* pathname)
 // remove the child from parent; the function is called by both
 // File_Unlink() and Dir_Unlink(); the function returns 0 if success,
 // -1 if general error, -2 if directory not empty, -3 if wrong type
-int remove_inode(int type, int parent_inode, int child_inode)
+int remove_inode(int type, int parent_inode, int child_inode, char* fname)
 {
     // load the disk sector containing the child inode
     int inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
     char inode_buffer[SECTOR_SIZE];
-    if (Disk_Read(inode_sector, inode_buffer) < 0) return -1;
+    if (cache_read(inode_sector, inode_buffer) < 0) return -1;
     dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
 
     // get the child inode
@@ -482,17 +1685,15 @@ int remove_inode(int type, int parent_inode, int child_inode)
     }
     else if (type == 0) {
         // reclaim all data blocks belonging to the file
-        for (int g = 0; g < child->size / SECTOR_SIZE; g++) {
-            bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, child->data[g]);
-            dprintf("... reclaimed data block sector %d\n", child->data[g]);
-        }
+        if (truncate_blocks(child, 0) < 0) return -1;
     }
-    bitmap_reset(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, child_inode);
+    bitmap_reset(&inode_bitmap, child_inode);
     dprintf("... reclaimed the child inode %d\n", child_inode);
+    if (type == 1) dcache_purge(child_inode);
 
     // now get the disk sector containing the parent inode
     inode_sector = INODE_TABLE_START_SECTOR + parent_inode / INODES_PER_SECTOR;
-    if (Disk_Read(inode_sector, inode_buffer) < 0) return -1;
+    if (cache_read(inode_sector, inode_buffer) < 0) return -1;
     dprintf("... load inode table for parent inode %d from disk sector %d\n",
         parent_inode, inode_sector);
 
@@ -506,239 +1707,1666 @@ int remove_inode(int type, int parent_inode, int child_inode)
     assert(parent->type == 1);
 
     // get the last dirent
-    parent->size--;
-    int group = parent->size / DIRENTS_PER_SECTOR;
+    int old_blocks = parent->blocks;
+    int last = parent->size - 1;
+    int group = last / DIRENTS_PER_SECTOR;
     char dirent_buffer[SECTOR_SIZE];
-    if (Disk_Read(parent->data[group], dirent_buffer) < 0) return -1;
+    int dirent_sector = map_block(parent, group, NULL);
+    if (dirent_sector < 0 || cache_read(dirent_sector, dirent_buffer) < 0) return -1;
     dprintf("... load disk sector %d for dirent group %d containing last entry (%d)\n",
-        parent->data[group], group, parent->size);
-    int start_entry = group * DIRENTS_PER_SECTOR;
-    offset = parent->size - start_entry;
+        dirent_sector, group, last);
     dirent_t last_one;
-    memcpy(&last_one, dirent_buffer + offset * sizeof(dirent_t), sizeof(dirent_t));
-    if (offset == 0) { // this group is no longer needed when we remove the last entry
-        bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, parent->data[group]);
-        dprintf("... reclaimed data block sector %d\n", parent->data[group]);
-    }
-
-    // update parent inode to disk
-    if (Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-    dprintf("... update parent inode on disk sector %d\n", inode_sector);
+    memcpy(&last_one, dirent_buffer + (last % DIRENTS_PER_SECTOR) * sizeof(dirent_t), sizeof(dirent_t));
 
     // time to fix the parent directory (replacing the child entry with
     // the last entry); however, if the last one happens to the be
-    // child, we already removed it, nothing more needs to be done
-    if (last_one.inode == child_inode) {
-        dprintf("... last entry is child inode, no need to do more\n");
-        return 0;
+    // child, removing the last entry is all we need
+    if (parent->index > 0) {
+        // the hash index tells where the child and last entries are
+        int child_slot, child_pos, last_slot, last_pos;
+        dirent_t dirent;
+        if (index_probe(parent, fname, &child_slot, &child_pos, &dirent) != 1) return -1;
+        assert(dirent.inode == child_inode);
+        if (child_pos != last) {
+            if (index_probe(parent, last_one.fname, &last_slot, &last_pos, &dirent) != 1) return -1;
+            assert(last_pos == last);
+            uint32_t entry;
+            if (index_get(parent, last_slot, &entry) < 0) return -1;
+            if (index_put(parent, last_slot, (entry & 0xffff0000) | (child_pos + 1)) < 0) return -1;
+
+            char buf[SECTOR_SIZE];
+            int sector = map_block(parent, child_pos / DIRENTS_PER_SECTOR, NULL);
+            if (sector < 0 || cache_read(sector, buf) < 0) return -1;
+            memcpy(&((dirent_t*)buf)[child_pos % DIRENTS_PER_SECTOR], &last_one, sizeof(dirent_t));
+            if (cache_write(sector, buf) < 0) return -1;
+            dprintf("... updated disk sector %d for dirent group %d replacing child\n",
+                sector, child_pos / DIRENTS_PER_SECTOR);
+        }
+        if (index_delete(parent, child_slot) < 0) return -1;
     }
+    else if (last_one.inode != child_inode) {
+        int nentries = last; // remaining number of directory entries 
+        int idx = 0, found = 0;
+        while (nentries > 0 && !found) {
+            char buf[SECTOR_SIZE]; // cached content of directory entries
+            int sector = map_block(parent, idx, NULL);
+            if (sector < 0 || cache_read(sector, buf) < 0) return -1;
+            for (int i = 0; i < DIRENTS_PER_SECTOR; i++) {
+                if (i >= nentries) break;
+                if (((dirent_t*)buf)[i].inode == child_inode) {
+                    // found the dirent for the removed child, replace it with
+                    // the last entry's dirent data
+                    memcpy(&((dirent_t*)buf)[i], &last_one, sizeof(dirent_t));
 
-    int nentries = parent->size; // remaining number of directory entries 
-    int idx = 0;
-    while (nentries > 0) {
-        char buf[SECTOR_SIZE]; // cached content of directory entries
-        if (Disk_Read(parent->data[idx], buf) < 0) return -1;
-        for (int i = 0; i < DIRENTS_PER_SECTOR; i++) {
-            if (i > nentries) break;
-            if (((dirent_t*)buf)[i].inode == child_inode) {
-                // found the dirent for the removed child, replace it with
-                // the last entry's dirent data
-                memcpy(&((dirent_t*)buf)[i], &last_one, sizeof(dirent_t));
-
-                // update the disk
-                if (Disk_Write(parent->data[idx], buf) < 0) return -1;
-                dprintf("... updated disk sector %d for dirent group %d replacing child\n",
-                    parent->data[idx], idx);
-                return 0;
+                    // update the disk
+                    if (cache_write(sector, buf) < 0) return -1;
+                    dprintf("... updated disk sector %d for dirent group %d replacing child\n",
+                        sector, idx);
+                    found = 1;
+                    break;
+                }
             }
+            idx++; nentries -= DIRENTS_PER_SECTOR;
+        }
+        if (!found) {
+            dprintf("... could not find child inode, ths cannot happen!\n");
+            assert(0);
+            return -1; // not found
         }
-        idx++; nentries -= DIRENTS_PER_SECTOR;
     }
-    dprintf("... could not find child inode, ths cannot happen!\n");
-    assert(0);
-    return -1; // not found
+    else dprintf("... last entry is child inode, no need to do more\n");
+
+    // drop the last entry; its group is no longer needed if it was the
+    // only entry there (and the hash index may need to shrink)
+    parent->size--;
+    if (last % DIRENTS_PER_SECTOR == 0) {
+        if (truncate_blocks(parent, group) < 0) return -1;
+        if (index_rebuild(parent, old_blocks) < 0) return -1;
+    }
+
+    // update parent inode to disk
+    if (cache_write_inode(parent_inode, parent, 0) < 0) return -1;
+    dprintf("... update parent inode on disk sector %d\n", inode_sector);
+    dcache_insert(parent_inode, fname, -1);
+    return 0;
 }
 
+// the number of data blocks read ahead grows (doubling) from
+// RA_MIN_BLOCKS to RA_MAX_BLOCKS while a file is read sequentially
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS 64
+
 // representing an open file
 typedef struct _open_file {
     int inode; // pointing to the inode of the file (0 means entry not used)
-    int size;  // file size cached here for convenience
     int pos;   // read/write position
+    int next;  // the next unused entry (if this one is not used)
+    pthread_mutex_t pos_lock; // guards the position
+
+    // read-ahead: the data blocks following a sequential read are
+    // brought into a buffer of the open file in one go (bulk data
+    // doesn't go into the sector cache)
+    pthread_mutex_t ra_lock; // guards the read-ahead state
+    int ra_next;   // where the next read continues a sequential read
+    int ra_window; // the number of blocks to read ahead (0 means none)
+    int ra_start;  // the first data block in the buffer
+    int ra_count;  // the number of data blocks in the buffer
+    int ra_gen;    // the generation of the file when the buffer was filled
+    char* ra_buf;  // the buffer (allocated when first needed)
 } open_file_t;
 static open_file_t open_files[MAX_OPEN_FILES];
 
-// return true if the file pointed to by inode has already been open
-int is_file_open(int inode)
+// the unused entries of the open file table are linked in a list
+// (-1 means the table is full)
+static int open_files_free;
+
+// the number of open file entries pointing to each inode (this and
+// the other arrays indexed by inode have 'open_files_max' entries)
+static int* open_count;
+static int open_files_max;
+
+// the inode of an open file is kept in memory (and shared by all open
+// file entries pointing to it) while the file is open; it's written
+// back only when it's changed, and then when the file is last closed
+// or the file system is synchronized
+static inode_t* open_inodes;
+static char* open_inode_dirty;
+
+// mark the open inode as changed or not (see cache_owed); the caller
+// holds the inode lock exclusively
+static void set_inode_dirty(int inode, int dirty)
 {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (open_files[i].inode == inode)
-            return 1;
-    }
-    return 0;
+    if (open_inode_dirty[inode] == dirty) return;
+    open_inode_dirty[inode] = dirty;
+    CACHE_OWE(dirty ? 1 : -1);
 }
 
-// return a new file descriptor not used; -1 if full
-int new_file_fd()
+// the generation of an open file changes whenever it's written (so
+// that the read-ahead buffers of the file can tell they're stale)
+static int* open_inode_gen;
+
+// the data appended to an open file is held back in memory (up to
+// PENDING_BLOCKS data blocks), and the data blocks are allocated and
+// written only when the file is last closed, the file system is
+// synchronized, or there's too much of it; the pending data always
+// starts at the end of the file on disk (as given by the inode's
+// size), so the size of the file is the inode's size plus the length
+// of the pending data
+#define PENDING_BLOCKS 64
+
+typedef struct _pending {
+    int len;   // the number of bytes pending
+    int cap;   // the size of buf
+    char* buf; // the pending data (allocated when first needed, one
+               // sector, and doubled as it fills up)
+} pending_t;
+static pending_t* open_pending;
+
+// return the size of the open file including the pending data
+static int open_file_size(int inode)
 {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (open_files[i].inode <= 0)
-            return i;
-    }
-    return -1;
+    return open_inodes[inode].size + open_pending[inode].len;
 }
 
-/* end of internal helper functions, start of API functions */
+// a directory open for reading remembers its inode, so each entry is
+// read (through the cache) without looking the directory up again
+typedef struct _open_dir {
+    int inode;  // the directory (-1 means entry not used)
+    int pos;    // the position of the next entry to return
+    int next;   // the next unused entry (in the free list)
+} open_dir_t;
+static open_dir_t open_dirs[MAX_OPEN_DIRS];
 
-int FS_Boot(char* backstore_fname)
+// the unused entries of the open directory table are linked in a list
+// (-1 means the table is full); guarded by 'fd_lock'
+static int open_dirs_free;
+
+// mark all entries of the open file and directory tables unused, and
+// allocate the arrays indexed by inode for the file system booted;
+// return 0 if successful, -1 otherwise
+static int open_files_init()
 {
-    dprintf("FS_Boot('%s'):\n", backstore_fname);
-    // initialize a new disk (this is a simulated disk)
-    if (Disk_Init() < 0) {
-        dprintf("... disk init failed\n");
-        osErrno = E_GENERAL;
+    for (int i = 0; i < MAX_OPEN_DIRS; i++) {
+        open_dirs[i].inode = -1;
+        open_dirs[i].next = (i + 1 < MAX_OPEN_DIRS) ? i + 1 : -1;
+    }
+    open_dirs_free = 0;
+    for (int i = 0; i < MAX_OPEN_FILES; i++) free(open_files[i].ra_buf);
+    for (int i = 0; i < open_files_max; i++) free(open_pending[i].buf);
+    free(open_count);
+    free(open_inodes);
+    free(open_inode_dirty);
+    free(open_inode_gen);
+    free(open_pending);
+    open_count = (int*)calloc(MAX_FILES, sizeof(int));
+    open_inodes = (inode_t*)calloc(MAX_FILES, sizeof(inode_t));
+    open_inode_dirty = (char*)calloc(MAX_FILES, 1);
+    open_inode_gen = (int*)calloc(MAX_FILES, sizeof(int));
+    open_pending = (pending_t*)calloc(MAX_FILES, sizeof(pending_t));
+    open_files_max = MAX_FILES;
+    memset(open_files, 0, MAX_OPEN_FILES * sizeof(open_file_t));
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        open_files[i].next = (i + 1 < MAX_OPEN_FILES) ? i + 1 : -1;
+        pthread_mutex_init(&open_files[i].pos_lock, NULL);
+        pthread_mutex_init(&open_files[i].ra_lock, NULL);
+    }
+    open_files_free = 0;
+    if (!open_count || !open_inodes || !open_inode_dirty || !open_inode_gen || !open_pending) {
+        open_files_max = 0;
         return -1;
     }
-    dprintf("... disk initialized\n");
-
-    // we should copy the filename down; if not, the user may change the
-    // content pointed to by 'backstore_fname' after calling this function
-    strncpy(bs_filename, backstore_fname, 1024);
-    bs_filename[1023] = '\0'; // for safety
-
-    // we first try to load disk from this file
-    if (Disk_Load(bs_filename) < 0) {
-        dprintf("... load disk from file '%s' failed\n", bs_filename);
-
-        // if we can't open the file; it means the file does not exist, we
-        // need to create a new file system on disk
-        if (diskErrno == E_OPENING_FILE) {
-            dprintf("... couldn't open file, create new file system\n");
-
-            // format superblock
-            char buf[SECTOR_SIZE];
-            memset(buf, 0, SECTOR_SIZE);
-            *(int*)buf = OS_MAGIC;
-            if (Disk_Write(SUPERBLOCK_START_SECTOR, buf) < 0) {
-                dprintf("... failed to format superblock\n");
-                osErrno = E_GENERAL;
-                return -1;
-            }
-            dprintf("... formatted superblock (sector %d)\n", SUPERBLOCK_START_SECTOR);
+    return 0;
+}
 
-            // format inode bitmap (reserve the first inode to root)
-            bitmap_init(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, 1);
-            dprintf("... formatted inode bitmap (start=%d, num=%d)\n",
-                (int)INODE_BITMAP_START_SECTOR, (int)INODE_BITMAP_SECTORS);
+// return true if the file pointed to by inode has already been open
+int is_file_open(int inode)
+{
+    pthread_mutex_lock(&fd_lock);
+    int found = open_count[inode] > 0;
+    pthread_mutex_unlock(&fd_lock);
+    return found;
+}
 
-            // format sector bitmap (reserve the first few sectors to
-            // superblock, inode bitmap, sector bitmap, and inode table)
-            bitmap_init(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
-                DATABLOCK_START_SECTOR);
-            dprintf("... formatted sector bitmap (start=%d, num=%d)\n",
-                (int)SECTOR_BITMAP_START_SECTOR, (int)SECTOR_BITMAP_SECTORS);
+// return a new file descriptor (not used) for the inode; -1 if full;
+// the caller holds 'fd_lock'
+int new_file_fd(int inode)
+{
+    int fd = open_files_free;
+    if (fd < 0) return -1;
+    open_files_free = open_files[fd].next;
+    open_files[fd].inode = inode;
+    open_files[fd].ra_next = 0;
+    open_files[fd].ra_window = 0;
+    open_files[fd].ra_count = 0;
+    open_count[inode]++;
+    return fd;
+}
 
-            // format inode tables
-            for (int i = 0; i < INODE_TABLE_SECTORS; i++) {
-                memset(buf, 0, SECTOR_SIZE);
-                if (i == 0) {
-                    // the first inode table entry is the root directory
-                    ((inode_t*)buf)->size = 0;
-                    ((inode_t*)buf)->type = 1;
-                }
-                if (Disk_Write(INODE_TABLE_START_SECTOR + i, buf) < 0) {
-                    dprintf("... failed to format inode table\n");
-                    osErrno = E_GENERAL;
-                    return -1;
-                }
-            }
-            dprintf("... formatted inode table (start=%d, num=%d)\n",
-                (int)INODE_TABLE_START_SECTOR, (int)INODE_TABLE_SECTORS);
+// release the file descriptor; the caller holds 'fd_lock'
+static void free_file_fd(int fd)
+{
+    open_count[open_files[fd].inode]--;
+    open_files[fd].inode = 0;
+    free(open_files[fd].ra_buf);
+    open_files[fd].ra_buf = NULL;
+    open_files[fd].next = open_files_free;
+    open_files_free = fd;
+}
 
-            // we need to synchronize the disk to the backstore file (so
-            // that we don't lose the formatted disk)
-            if (Disk_Save(bs_filename) < 0) {
-                // if can't write to file, something's wrong with the backstore
-                dprintf("... failed to save disk to file '%s'\n", bs_filename);
-                osErrno = E_GENERAL;
-                return -1;
-            }
-            else {
-                // everything's good now, boot is successful
-                dprintf("... successfully formatted disk, boot successful\n");
-                memset(open_files, 0, MAX_OPEN_FILES * sizeof(open_file_t));
-                return 0;
-            }
-        }
-        else {
-            // something wrong loading the file: invalid param or error reading
-            dprintf("... couldn't read file '%s', boot failed\n", bs_filename);
-            osErrno = E_GENERAL;
-            return -1;
-        }
+// check that 'fd' is an open file; return 0 if OK, and -1 (with
+// osErrno set) if not
+static int check_open_file(int fd)
+{
+    if (0 > fd || fd >= MAX_OPEN_FILES) {
+        dprintf("... fd=%d out of bound\n", fd);
+        osErrno = E_BAD_FD;
+        return -1;
     }
-    else {
-        dprintf("... load disk from file '%s' successful\n", bs_filename);
-
-        // we successfully loaded the disk, we need to do two more checks,
-        // first the file size must be exactly the size as expected (thiis
-        // supposedly should be folded in Disk_Load(); and it's not)
-        int sz = 0;
-        FILE* f = fopen(bs_filename, "r");
-        if (f) {
-            fseek(f, 0, SEEK_END);
-            sz = ftell(f);
-            fclose(f);
-        }
-        if (sz != SECTOR_SIZE * TOTAL_SECTORS) {
-            dprintf("... check size of file '%s' failed\n", bs_filename);
-            osErrno = E_GENERAL;
-            return -1;
-        }
-        dprintf("... check size of file '%s' successful\n", bs_filename);
-
-        // check magic
-        if (check_magic()) {
-            // everything's good by now, boot is successful
-            dprintf("... check magic successful\n");
-            memset(open_files, 0, MAX_OPEN_FILES * sizeof(open_file_t));
-            return 0;
-        }
-        else {
-            // mismatched magic number
-            dprintf("... check magic failed, boot failed\n");
-            osErrno = E_GENERAL;
-            return -1;
-        }
+    if (open_files[fd].inode <= 0) {
+        dprintf("... fd=%d not an open file\n", fd);
+        osErrno = E_BAD_FD;
+        return -1;
     }
+    return 0;
 }
 
-int FS_Sync()
+// check the buffers and the offset given to a positional read or
+// write; return 0 if OK, and -1 (with osErrno set) if not
+static int check_iovec(struct iovec* iov, int iovcnt, int offset)
 {
-    if (Disk_Save(bs_filename) < 0) {
-        // if can't write to file, something's wrong with the backstore
-        dprintf("FS_Sync():\n... failed to save disk to file '%s'\n", bs_filename);
+    if (!iov || iovcnt < 0 || offset < 0) {
+        dprintf("... invalid buffer or offset parameter\n");
         osErrno = E_GENERAL;
         return -1;
     }
-    else {
-        // everything's good now, sync is successful
-        dprintf("FS_Sync():\n... successfully saved disk to file '%s'\n", bs_filename);
-        return 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if ((!iov[i].iov_base && iov[i].iov_len > 0) || iov[i].iov_len > INT_MAX) {
+            dprintf("... invalid buffer or size parameter\n");
+            osErrno = E_GENERAL;
+            return -1;
+        }
     }
+    return 0;
 }
 
-int File_Create(char* file)
+// bring the inode of a file being opened for the first time into
+// memory; the caller holds 'fd_lock'; return 0 if successful, -1
+// otherwise
+static int load_open_inode(int inode)
 {
-    dprintf("File_Create('%s'):\n", file);
-    return create_file_or_directory(0, file);
+    int inode_sector = INODE_TABLE_START_SECTOR + inode / INODES_PER_SECTOR;
+    char inode_buffer[SECTOR_SIZE];
+    if (cache_read(inode_sector, inode_buffer) < 0) return -1;
+    dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
+    memcpy(&open_inodes[inode], inode_buffer + (inode % INODES_PER_SECTOR) * sizeof(inode_t),
+        sizeof(inode_t));
+    set_inode_dirty(inode, 0);
+    assert(open_inodes[inode].type == 0);
+    return 0;
 }
 
-int File_Unlink(char* file)
+// fill the read-ahead buffer of the open file 'of' (whose inode is
+// 'inode') with the data blocks starting from 'gidx', and widen the
+// window for next time; return 0 if successful, -1 otherwise
+static int read_ahead(inode_t* inode, open_file_t* of, int gidx)
 {
-    dprintf("FS_Unlink('%s'):\n", file);
+    if (!of->ra_buf) {
+        of->ra_buf = malloc(RA_MAX_BLOCKS * SECTOR_SIZE);
+        if (!of->ra_buf) return -1;
+    }
+    int want = of->ra_window;
+    if (want > inode->blocks - gidx) want = inode->blocks - gidx;
+    of->ra_count = 0;
+
+    // the extents in the window are read all at once (the data blocks
+    // are never dirty in the cache, so they're read from the disk)
+    disk_io_t io[RA_MAX_BLOCKS];
+    int n = 0;
+    for (int i = 0; i < want; n++) {
+        int run;
+        int sector = map_block(inode, gidx + i, &run);
+        if (sector < 0) return -1;
+        if (run > want - i) run = want - i;
+        io[n].write = 0;
+        io[n].sector = sector;
+        io[n].num = run;
+        io[n].buffer = of->ra_buf + i * SECTOR_SIZE;
+        i += run;
+    }
+    if (disk_io(io, n) < 0) return -1;
+    dprintf("... read ahead data blocks %d..%d\n", gidx, gidx + want - 1);
+    of->ra_start = gidx;
+    of->ra_count = want;
+    of->ra_gen = open_inode_gen[of->inode];
+    of->ra_window *= 2;
+    if (of->ra_window > RA_MAX_BLOCKS) of->ra_window = RA_MAX_BLOCKS;
+    return 0;
+}
+
+// read 'size' bytes of the file represented by 'inode' starting from
+// 'pos' into 'buffer' (but never beyond the end of file), going
+// through the read-ahead buffer of the open file 'of' if it's not
+// NULL; return the number of bytes read, or -1 if there's read error
+static int read_data(inode_t* inode, open_file_t* of, char* buffer, int size, int pos)
+{
+    if (size > inode->size - pos) size = inode->size - pos;
+    if (INODE_INLINE(inode)) {
+        if (size < 0) size = 0;
+        memcpy(buffer, inode->data + pos, size);
+        dprintf("... copied inline data from %d to %d of size %d\n", pos, pos + size, size);
+        return size;
+    }
+    if (of && of->ra_gen != open_inode_gen[of->inode]) of->ra_count = 0;
+
+    // read one extent (or the partial data block at either end) at a time
+    int bidx = 0, remain = size;
+    while (remain > 0) {
+        int gidx = pos / SECTOR_SIZE;
+        int offset = pos - gidx * SECTOR_SIZE;
+        int run, n;
+        if (of && of->ra_start <= gidx && gidx < of->ra_start + of->ra_count) {
+            // the data has been read ahead
+            n = (of->ra_start + of->ra_count) * SECTOR_SIZE - pos;
+            if (n > remain) n = remain;
+            memcpy(&buffer[bidx], of->ra_buf + (pos - of->ra_start * SECTOR_SIZE), n);
+            pos += n; bidx += n; remain -= n;
+            continue;
+        }
+        if (of && of->ra_window > 0 && (offset > 0 || remain < of->ra_window * SECTOR_SIZE)
+            && read_ahead(inode, of, gidx) == 0)
+            continue; // the data is in the read-ahead buffer now
+        int sector = map_block(inode, gidx, &run);
+        if (sector < 0) return -1;
+
+        if (offset > 0 || remain < SECTOR_SIZE) {
+            // load in the data block and copy the part we need
+            char data[SECTOR_SIZE];
+            n = SECTOR_SIZE - offset;
+            if (n > remain) n = remain;
+            if (cache_read(sector, data) < 0) return -1;
+            memcpy(&buffer[bidx], &data[offset], n);
+        }
+        else {
+            // whole data blocks go straight into the user buffer
+            int nsec = remain / SECTOR_SIZE;
+            if (nsec > run) nsec = run;
+            if (cache_read_run(sector, nsec, &buffer[bidx]) < 0) return -1;
+            n = nsec * SECTOR_SIZE;
+        }
+        dprintf("... load data from group %d disk sector %d, copied data from %d to %d of size %d\n",
+            gidx, sector, pos, pos + n, n);
+        pos += n; bidx += n; remain -= n;
+    }
+    return bidx;
+}
+
+// move the data kept in the inode of a small file to a data block, as
+// the file grows to 'want' data blocks (which are allocated in one run
+// if possible); return 0 if successful, -1 (with osErrno set) otherwise
+static int spill_inline(inode_t* inode, int want)
+{
+    char data[SECTOR_SIZE];
+    int size = inode->size;
+    memset(data, 0, SECTOR_SIZE);
+    memcpy(data, inode->data, size);
+    memset(inode->data, 0, INLINE_DATA_SIZE);
+    if (append_blocks(inode, want) < 0) {
+        memcpy(inode->data, data, size);
+        return -1;
+    }
+    if (cache_write_run(inode->extent[0].start, 1, data) < 0) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    dprintf("... moved %d bytes of inline data to disk sector %d\n", size, inode->extent[0].start);
+    return 0;
+}
+
+// write 'size' bytes from 'buffer' to the file represented by 'inode'
+// starting from 'pos' (no further than the end of file), allocating
+// new data blocks as needed; the inode's size is updated but the
+// inode is not written to disk; return the number of bytes written,
+// or -1 (with osErrno set) if there's error
+static int write_data(inode_t* inode, char* buffer, int size, int pos)
+{
+    assert(pos <= inode->size);
+
+    // the data of a small file stays in the inode
+    if (inode->type == 0 && inode->blocks == 0 && pos + size <= INLINE_DATA_SIZE) {
+        memcpy(inode->data + pos, buffer, size);
+        if (pos + size > inode->size) inode->size = pos + size;
+        dprintf("... copied inline data from %d to %d of size %d\n", pos, pos + size, size);
+        return size;
+    }
+    if (INODE_INLINE(inode) && spill_inline(inode, (pos + size + SECTOR_SIZE - 1) / SECTOR_SIZE) < 0)
+        return -1;
+
+    // write one extent (or the partial data block at either end) at a time
+    int bidx = 0, remain = size;
+    while (remain > 0) {
+        int gidx = pos / SECTOR_SIZE;
+        int offset = pos - gidx * SECTOR_SIZE;
+        if (gidx >= inode->blocks) {
+            // the pointer has moved beyond allocated blocks, allocate as
+            // many as we need for the rest of the data (hopefully in one
+            // run); this sort of in-the-middle handling may cause
+            // inconsistencies if it fails
+            int want = (offset + remain + SECTOR_SIZE - 1) / SECTOR_SIZE;
+            if (append_blocks(inode, want) < 0) return -1;
+        }
+        int run, n;
+        int sector = map_block(inode, gidx, &run);
+        if (sector < 0) { osErrno = E_GENERAL; return -1; }
+
+        if (offset > 0 || remain < SECTOR_SIZE) {
+            // a partial data block: if it's still in the file, load it
+            // from disk, otherwise start from a clean one
+            char data[SECTOR_SIZE];
+            n = SECTOR_SIZE - offset;
+            if (n > remain) n = remain;
+            if (gidx * SECTOR_SIZE < inode->size) {
+                if (cache_read(sector, data) < 0) { osErrno = E_GENERAL; return -1; }
+            }
+            else memset(data, 0, SECTOR_SIZE);
+            memcpy(&data[offset], &buffer[bidx], n);
+            if (cache_write_run(sector, 1, data) < 0) { osErrno = E_GENERAL; return -1; }
+        }
+        else {
+            // whole data blocks go straight from the user buffer
+            int nsec = remain / SECTOR_SIZE;
+            if (nsec > run) nsec = run;
+            if (cache_write_run(sector, nsec, &buffer[bidx]) < 0) { osErrno = E_GENERAL; return -1; }
+            n = nsec * SECTOR_SIZE;
+        }
+        dprintf("... update group %d disk sector %d, copied data from %d to %d of size %d\n",
+            gidx, sector, pos, pos + n, n);
+        pos += n; bidx += n; remain -= n;
+        if (pos > inode->size) inode->size = pos;
+    }
+    return bidx;
+}
+
+// write the pending data of the open file to disk, so that all the
+// data blocks it needs are allocated in one run and written in one
+// pass; if that fails, the data that couldn't be written is dropped;
+// return 0 if successful, -1 (with osErrno set) otherwise
+static int flush_pending(int inode)
+{
+    pending_t* p = &open_pending[inode];
+    if (p->len == 0) return 0;
+    int n = write_data(&open_inodes[inode], p->buf, p->len, open_inodes[inode].size);
+    dprintf("... flushed %d pending bytes of inode %d\n", n < 0 ? -1 : n, inode);
+    p->len = 0;
+    set_inode_dirty(inode, 1);
+    open_inode_gen[inode]++;
+    return n < 0 ? -1 : 0;
+}
+
+// write the pending data and the in-memory inodes of the open files
+// back (if changed); return 0 if successful, -1 otherwise
+static int flush_open_inodes()
+{
+    int ret = 0;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (open_count[i] == 0) continue;
+        if (flush_pending(i) < 0) ret = -1;
+        if (open_inode_dirty[i]) {
+            if (cache_write_inode(i, &open_inodes[i], 1) < 0) return -1;
+            set_inode_dirty(i, 0);
+            dprintf("... write back inode %d of open file\n", i);
+        }
+    }
+    return ret;
+}
+
+// write 'size' bytes from 'buffer' to the open file starting from
+// 'pos' (no further than the end of file); the data within the file
+// on disk is written right away, while the data beyond is added to
+// the pending data (which is flushed first if it would grow too
+// big); a write too big for the pending data goes straight to disk;
+// return the number of bytes written, or -1 (with osErrno set) if
+// there's error
+static int write_pending(int inode, char* buffer, int size, int pos)
+{
+    inode_t* in = &open_inodes[inode];
+    pending_t* p = &open_pending[inode];
+    int bidx = 0;
+    while (bidx < size) {
+        int remain = size - bidx, n;
+        if (pos < in->size || (p->len == 0 && remain > PENDING_BLOCKS * SECTOR_SIZE)) {
+            n = remain;
+            if (pos < in->size && n > in->size - pos) n = in->size - pos;
+            n = write_data(in, &buffer[bidx], n, pos);
+            if (n < 0) return -1;
+        }
+        else {
+            int at = pos - in->size;
+            assert(at <= p->len);
+            if (at + remain > PENDING_BLOCKS * SECTOR_SIZE) {
+                if (flush_pending(inode) < 0) return -1;
+                continue;
+            }
+            if (at + remain > p->cap) {
+                int cap = p->cap ? p->cap : SECTOR_SIZE;
+                while (cap < at + remain) cap *= 2;
+                if (cap > PENDING_BLOCKS * SECTOR_SIZE) cap = PENDING_BLOCKS * SECTOR_SIZE;
+                char* buf = realloc(p->buf, cap);
+                if (!buf) { osErrno = E_GENERAL; return -1; }
+                p->buf = buf;
+                p->cap = cap;
+            }
+            n = remain;
+            memcpy(p->buf + at, &buffer[bidx], n);
+            if (at + n > p->len) p->len = at + n;
+        }
+        pos += n; bidx += n;
+    }
+    return bidx;
+}
+
+// write everything the file system keeps in memory to the cache (and
+// the pending data to disk); return 0 if successful, -1 otherwise
+static int fs_flush()
+{
+    if (flush_open_inodes() < 0) return -1;
+    if (bitmap_flush(&inode_bitmap) < 0) return -1;
+    return bitmap_flush(&sector_bitmap);
+}
+
+// the header sector and the sectors of a transaction, as they are in
+// the journal
+static char* journal_buf;
+
+// return the checksum (FNV-1a) of the transaction
+static uint32_t journal_checksum(journal_header_t* jh, char* blocks)
+{
+    uint32_t h = 2166136261u;
+    unsigned char* p = (unsigned char*)&jh->seq;
+    for (int i = 0; i < 2 * sizeof(uint32_t); i++) h = (h ^ p[i]) * 16777619u;
+    p = (unsigned char*)jh->home;
+    for (int i = 0; i < jh->count * sizeof(int); i++) h = (h ^ p[i]) * 16777619u;
+    p = (unsigned char*)blocks;
+    for (int i = 0; i < jh->count * SECTOR_SIZE; i++) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+// write all dirty sectors in the cache to the journal as one
+// transaction and save it to the backstore file; the sectors stay
+// dirty in the cache; return 0 if successful, -1 otherwise
+static int journal_commit()
+{
+    journal_header_t* jh = (journal_header_t*)journal_buf;
+    char* blocks = journal_buf + SECTOR_SIZE;
+    memset(journal_buf, 0, SECTOR_SIZE);
+    int n = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (int e = 0; e < CACHE_SECTORS; e++) {
+        if (cache[e].sector >= 0 && cache[e].dirty) {
+            jh->home[n] = cache[e].sector;
+            memcpy(blocks + n * SECTOR_SIZE, cache[e].data, SECTOR_SIZE);
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (n == 0) return 0;
+
+    jh->magic = JOURNAL_MAGIC;
+    jh->seq = journal_seq + 1;
+    jh->count = n;
+    jh->checksum = journal_checksum(jh, blocks);
+    journal_valid = 1; // even if only in part
+    if (Disk_WriteSectors(JOURNAL_START_SECTOR, 1 + n, journal_buf) < 0 ||
+        Disk_SaveDirty(bs_filename) < 0) return -1;
+    journal_seq = jh->seq;
+    dprintf("... committed transaction %u (%d sectors)\n", jh->seq, n);
+    return 0;
+}
+
+// mark the transaction in the journal as checkpointed (keeping its
+// sequence number), so that it's not replayed at the next boot, nor
+// over the sectors that may be reused; return 0 if successful, -1
+// otherwise
+static int journal_clear()
+{
+    journal_header_t* jh = (journal_header_t*)journal_buf;
+    memset(journal_buf, 0, SECTOR_SIZE);
+    jh->magic = JOURNAL_MAGIC;
+    jh->seq = journal_seq;
+    if (Disk_Write(JOURNAL_START_SECTOR, journal_buf) < 0 ||
+        Disk_SaveDirty(bs_filename) < 0) return -1;
+    journal_valid = 0;
+    return 0;
+}
+
+// replay the transaction in the journal (if it's complete) by writing
+// its sectors to their home locations; return 0 if successful (or if
+// there's nothing to replay), -1 otherwise
+static int journal_replay()
+{
+    journal_header_t* jh = (journal_header_t*)journal_buf;
+    char* blocks = journal_buf + SECTOR_SIZE;
+    journal_seq = 0;
+    journal_valid = 0;
+    if (Disk_Read(JOURNAL_START_SECTOR, journal_buf) < 0) return -1;
+    if (jh->magic != JOURNAL_MAGIC) return 0;
+    journal_seq = jh->seq;
+    if (jh->count == 0 || jh->count > JOURNAL_BLOCKS) return 0;
+    if (Disk_ReadSectors(JOURNAL_START_SECTOR + 1, jh->count, blocks) < 0) return -1;
+    if (journal_checksum(jh, blocks) != jh->checksum) {
+        dprintf("... incomplete transaction %u in journal, ignored\n", jh->seq);
+        return 0;
+    }
+    for (int i = 0; i < jh->count; i++) {
+        int home = jh->home[i];
+        if (home < 0 || home >= TOTAL_SECTORS ||
+            (JOURNAL_START_SECTOR <= home && home < DATABLOCK_START_SECTOR)) {
+            dprintf("... bad sector %d in journal, ignored\n", home);
+            continue;
+        }
+        if (Disk_Write(home, blocks + i * SECTOR_SIZE) < 0) return -1;
+    }
+    dprintf("... replayed transaction %u (%d sectors)\n", jh->seq, (int)jh->count);
+    cache_init(); // the cached sectors may be stale
+
+    // the transaction stays in the journal until the sectors are saved,
+    // so if they can't be saved now (the file may be read-only), they're
+    // saved later or replayed again at the next boot
+    journal_valid = 1;
+    if (Disk_SaveDirty(bs_filename) < 0 || journal_clear() < 0)
+        dprintf("... replayed sectors not saved to file '%s'\n", bs_filename);
+    return 0;
+}
+
+// make all changes since the last commit durable: the data blocks are
+// saved to the backstore file first, then the changed metadata
+// sectors are committed to the journal, and only after that are they
+// written to their home locations (checkpoint), so a crash at any
+// point leaves either the old or the new metadata after replay; the
+// caller holds 'fs_lock' exclusively; return 0 if successful, -1
+// otherwise
+static int fs_commit()
+{
+    cache_committing = 1;
+    int err = fs_flush() < 0;
+    cache_committing = 0;
+    if (err || Disk_SaveDirty(bs_filename) < 0) return -1;
+    if (journal_commit() < 0) return -1;
+    if (cache_flush() < 0 || Disk_SaveDirty(bs_filename) < 0) return -1;
+
+    // once checkpointed, the transaction is gone from the journal, and
+    // only then can the sectors it freed be reused
+    if (journal_valid && journal_clear() < 0) return -1;
+    pthread_mutex_lock(&alloc_lock);
+    bitmap_release(&sector_bitmap);
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+}
+
+/* end of internal helper functions, start of API functions */
+
+// find the geometry of the file system in the superblock of the
+// backstore file; if the file doesn't exist, the default geometry is
+// used (for a new file system); return 0 if successful, -1 otherwise
+static int read_geometry(char* backstore_fname, superblock_t* geometry)
+{
+    superblock_t* sb = geometry;
+    if (Disk_ReadHeader(backstore_fname, (char*)sb, sizeof(superblock_t)) < 0) {
+        if (diskErrno != E_OPENING_FILE || errno != ENOENT) return -1;
+        sb->sector_size = DEFAULT_SECTOR_SIZE;
+        sb->total_sectors = DEFAULT_TOTAL_SECTORS;
+        sb->max_files = DEFAULT_MAX_FILES;
+        return 0;
+    }
+    if (sb->magic != OS_MAGIC) return -1;
+    if (sb->version != OS_VERSION) {
+        dprintf("... unsupported format version %d\n", sb->version);
+        return -1;
+    }
+    return 0;
+}
+
+// set up the disk and allocate the memory sized by the geometry of the
+// file system; return 0 if successful, -1 otherwise
+static int setup_geometry(superblock_t* geometry)
+{
+    if (geometry->max_files <= 0) return -1;
+    if (Disk_InitGeometry(geometry->sector_size, geometry->total_sectors) < 0) return -1;
+    max_files = geometry->max_files;
+    if (DATABLOCK_START_SECTOR >= TOTAL_SECTORS) {
+        dprintf("... disk too small for %d inodes\n", MAX_FILES);
+        return -1;
+    }
+    dprintf("... geometry: sector size %d, %d sectors, %d inodes\n",
+        SECTOR_SIZE, TOTAL_SECTORS, MAX_FILES);
+
+    // nobody holds the inode locks while the file system is booted
+    if (inode_locks_count < MAX_FILES) {
+        for (int i = 0; i < inode_locks_count; i++) pthread_rwlock_destroy(&inode_locks[i]);
+        free(inode_locks);
+        inode_locks_count = 0;
+        inode_locks = (pthread_rwlock_t*)malloc(MAX_FILES * sizeof(pthread_rwlock_t));
+        if (!inode_locks) return -1;
+        for (int i = 0; i < MAX_FILES; i++) pthread_rwlock_init(&inode_locks[i], NULL);
+        inode_locks_count = MAX_FILES;
+    }
+
+    free(journal_buf);
+    journal_buf = (char*)malloc((size_t)JOURNAL_SECTORS * SECTOR_SIZE);
+    if (!journal_buf || cache_setup() < 0) return -1;
+    return 0;
+}
+
+// boot the file system from the backstore file; if 'format' is given,
+// a new file system with its geometry is created in the file, which
+// is overwritten if it exists
+static int boot_fs(char* backstore_fname, superblock_t* format)
+{
+    dprintf("FS_Boot('%s'):\n", backstore_fname);
+    // initialize a new disk (this is a simulated disk) with the
+    // geometry of the file system
+    superblock_t geometry;
+    if (format) geometry = *format;
+    else if (read_geometry(backstore_fname, &geometry) < 0) {
+        dprintf("... check magic failed, boot failed\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    if (setup_geometry(&geometry) < 0 || open_files_init() < 0) {
+        dprintf("... disk init failed\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    dprintf("... disk initialized\n");
+    cache_init();
+    dcache_init();
+    batch_depth = 0;
+    batch_dir_len = -1;
+    cache_owed = 0;
+    if (bitmap_setup(&inode_bitmap, INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, MAX_FILES, 0) < 0 ||
+        bitmap_setup(&sector_bitmap, SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, TOTAL_SECTORS, 1) < 0) {
+        dprintf("... bitmap init failed\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    // we should copy the filename down; if not, the user may change the
+    // content pointed to by 'backstore_fname' after calling this function
+    strncpy(bs_filename, backstore_fname, 1024);
+    bs_filename[1023] = '\0'; // for safety
+
+    // we first try to load disk from this file (the size of the file is
+    // checked there as well), unless we're told to format it
+    int loaded = format ? -1 : load_backstore(bs_filename);
+    int missing = !format && loaded < 0 && diskErrno == E_OPENING_FILE && errno == ENOENT;
+    if (loaded < 0) {
+        if (!format) dprintf("... load disk from file '%s' failed\n", bs_filename);
+
+        // if the file does not exist, we need to create a new file
+        // system on disk (a file we can't open for any other reason is
+        // left alone)
+        if (format || missing) {
+            dprintf("... create new file system\n");
+
+            // format superblock
+            char buf[SECTOR_SIZE];
+            memset(buf, 0, SECTOR_SIZE);
+            *(superblock_t*)buf = geometry;
+            ((superblock_t*)buf)->magic = OS_MAGIC;
+            ((superblock_t*)buf)->version = OS_VERSION;
+            if (cache_write(SUPERBLOCK_START_SECTOR, buf) < 0) {
+                dprintf("... failed to format superblock\n");
+                osErrno = E_GENERAL;
+                return -1;
+            }
+            dprintf("... formatted superblock (sector %d)\n", SUPERBLOCK_START_SECTOR);
+
+            // format inode bitmap (reserve the first inode to root)
+            // and sector bitmap (reserve the first few sectors to
+            // superblock, inode bitmap, sector bitmap, inode table, and
+            // journal)
+            if (bitmap_init(&inode_bitmap, 1) < 0 ||
+                bitmap_init(&sector_bitmap, DATABLOCK_START_SECTOR) < 0) {
+                dprintf("... failed to format bitmaps\n");
+                osErrno = E_GENERAL;
+                return -1;
+            }
+            dprintf("... formatted inode bitmap (start=%d, num=%d)\n",
+                (int)INODE_BITMAP_START_SECTOR, (int)INODE_BITMAP_SECTORS);
+            dprintf("... formatted sector bitmap (start=%d, num=%d)\n",
+                (int)SECTOR_BITMAP_START_SECTOR, (int)SECTOR_BITMAP_SECTORS);
+
+            // format inode tables (all cleared in one write, and then
+            // the first inode table entry is the root directory)
+            char* table = calloc(INODE_TABLE_SECTORS, SECTOR_SIZE);
+            memset(buf, 0, SECTOR_SIZE);
+            ((inode_t*)buf)->size = 0;
+            ((inode_t*)buf)->type = 1;
+            int err = !table || cache_write_run(INODE_TABLE_START_SECTOR, INODE_TABLE_SECTORS, table) < 0 ||
+                cache_write(INODE_TABLE_START_SECTOR, buf) < 0;
+            free(table);
+            if (err) {
+                dprintf("... failed to format inode table\n");
+                osErrno = E_GENERAL;
+                return -1;
+            }
+            dprintf("... formatted inode table (start=%d, num=%d)\n",
+                (int)INODE_TABLE_START_SECTOR, (int)INODE_TABLE_SECTORS);
+
+            // we need to synchronize the disk to the backstore file (so
+            // that we don't lose the formatted disk)
+            journal_seq = 0;
+            if (fs_flush() < 0 || cache_flush() < 0 || Disk_Save(bs_filename) < 0) {
+                // if can't write to file, something's wrong with the backstore
+                dprintf("... failed to save disk to file '%s'\n", bs_filename);
+                osErrno = E_GENERAL;
+                return -1;
+            }
+            else {
+                // everything's good now, boot is successful
+                dprintf("... successfully formatted disk, boot successful\n");
+                return 0;
+            }
+        }
+        else {
+            // something wrong loading the file: invalid param or error reading
+            dprintf("... couldn't read file '%s', boot failed\n", bs_filename);
+            osErrno = E_GENERAL;
+            return -1;
+        }
+    }
+    else {
+        dprintf("... load disk from file '%s' successful\n", bs_filename);
+
+        // we successfully loaded the disk, we need to check magic (and
+        // then replay the journal and bring the bitmaps into memory)
+        if (check_magic() && journal_replay() == 0 && bitmap_load(&inode_bitmap) == 0 &&
+            bitmap_load(&sector_bitmap) == 0) {
+            // everything's good by now, boot is successful
+            dprintf("... check magic successful\n");
+            return 0;
+        }
+        else {
+            // mismatched magic number
+            dprintf("... check magic failed, boot failed\n");
+            osErrno = E_GENERAL;
+            return -1;
+        }
+    }
+}
+
+// the file system may be served by a daemon (see FSProto.h); if so,
+// FS_Boot() connects to it and every call is sent to it over the
+// socket, which is shared by all threads (one request and its reply
+// at a time)
+static int remote_fd = -1;
+static pthread_mutex_t remote_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// connect to the daemon serving the disk file; return the socket, or
+// -1 if there's no daemon
+static int remote_connect(char* fname)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (!fname || strlen(fname) + strlen(FS_SOCKET_SUFFIX) >= sizeof(addr.sun_path)) return -1;
+    sprintf(addr.sun_path, "%s%s", fname, FS_SOCKET_SUFFIX);
+    if (access(addr.sun_path, F_OK) < 0) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    dprintf("... connected to the daemon at '%s'\n", addr.sun_path);
+    return fd;
+}
+
+static void remote_disconnect()
+{
+    if (remote_fd >= 0) close(remote_fd);
+    remote_fd = -1;
+}
+
+// send the buffers to the daemon in full; return 0 if successful, -1
+// otherwise
+static int remote_send(struct iovec* iov, int iovcnt)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(remote_fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) return -1;
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// receive 'len' bytes from the daemon; return 0 if successful, -1
+// otherwise
+static int remote_recv(void* buffer, int len)
+{
+    while (len > 0) {
+        ssize_t n = recv(remote_fd, buffer, len, 0);
+        if (n <= 0) return -1;
+        buffer = (char*)buffer + n;
+        len -= n;
+    }
+    return 0;
+}
+
+// send a request to the daemon and wait for the reply, whose data (no
+// more than 'max' bytes) goes into 'reply'; return what the call
+// returned (with osErrno set if it failed)
+static int remote_call(int op, int a0, int a1, int a2, void* data, int len, void* reply, int max)
+{
+    FS_Request_t req;
+    req.op = op;
+    req.arg[0] = a0;
+    req.arg[1] = a1;
+    req.arg[2] = a2;
+    req.len = len;
+    struct iovec iov[2] = { { &req, sizeof(req) }, { data, len } };
+    FS_Reply_t rep;
+    pthread_mutex_lock(&remote_lock);
+    int ok = remote_send(iov, len > 0 ? 2 : 1) == 0 && remote_recv(&rep, sizeof(rep)) == 0 &&
+        0 <= rep.len && rep.len <= max && remote_recv(reply, rep.len) == 0;
+    pthread_mutex_unlock(&remote_lock);
+    if (!ok) {
+        dprintf("... lost the connection to the daemon\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    if (rep.ret < 0) osErrno = rep.err;
+    return rep.ret;
+}
+
+// send a request whose only argument is a path
+static int remote_path(int op, char* path)
+{
+    if (!path) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    return remote_call(op, 0, 0, 0, path, strlen(path) + 1, NULL, 0);
+}
+
+// read (at most FS_MAX_DATA bytes at a time) from 'offset', or from
+// the file position if it's -1
+static int remote_read(int fd, char* buffer, int size, int offset)
+{
+    int done = 0;
+    while (done < size) {
+        int n = size - done;
+        if (n > FS_MAX_DATA) n = FS_MAX_DATA;
+        int ret = remote_call(FS_REQ_FILE_READ, fd, n, offset < 0 ? -1 : offset + done,
+            NULL, 0, buffer + done, n);
+        if (ret < 0) return -1;
+        done += ret;
+        if (ret < n) break; // end of file
+    }
+    return done;
+}
+
+static int remote_write(int fd, char* buffer, int size, int offset)
+{
+    int done = 0;
+    do {
+        int n = size - done;
+        if (n > FS_MAX_DATA) n = FS_MAX_DATA;
+        int ret = remote_call(FS_REQ_FILE_WRITE, fd, offset < 0 ? -1 : offset + done, 0,
+            buffer + done, n, NULL, 0);
+        if (ret < 0) return -1;
+        done += ret;
+        if (ret < n) break;
+    } while (done < size);
+    return done;
+}
+
+static int remote_readv(int fd, struct iovec* iov, int iovcnt, int offset)
+{
+    int pos = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        int n = remote_read(fd, iov[i].iov_base, iov[i].iov_len, offset + pos);
+        if (n < 0) return -1;
+        pos += n;
+        if (n < (int)iov[i].iov_len) break; // end of file
+    }
+    return pos;
+}
+
+static int remote_writev(int fd, struct iovec* iov, int iovcnt, int offset)
+{
+    int pos = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        int n = remote_write(fd, iov[i].iov_base, iov[i].iov_len, offset + pos);
+        if (n < 0) return -1;
+        pos += n;
+    }
+    return pos;
+}
+
+// the paths are sent in groups of no more than FS_MAX_DATA bytes, all
+// in one batch
+static int remote_many(int op, char** paths, int n, int* results)
+{
+    char* buf = malloc(FS_MAX_DATA);
+    int* res = malloc(n * sizeof(int) + 1);
+    if (!buf || !res) {
+        free(buf);
+        free(res);
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    int okay = 0, ret = remote_call(FS_REQ_BEGIN_BATCH, 0, 0, 0, NULL, 0, NULL, 0);
+    for (int i = 0; ret >= 0 && i < n; ) {
+        int j = i, len = 0;
+        while (j < n && paths[j] && len + (int)strlen(paths[j]) + 1 <= FS_MAX_DATA) {
+            strcpy(buf + len, paths[j]);
+            len += strlen(paths[j++]) + 1;
+        }
+        if (j == i) { // a path too long (or missing)
+            res[i++] = E_GENERAL;
+            continue;
+        }
+        ret = remote_call(op, j - i, 0, 0, buf, len, res + i, (j - i) * sizeof(int));
+        if (ret >= 0) okay += ret;
+        i = j;
+    }
+    if (remote_call(FS_REQ_COMMIT_BATCH, 0, 0, 0, NULL, 0, NULL, 0) < 0) ret = -1;
+    if (ret >= 0 && results) memcpy(results, res, n * sizeof(int));
+    free(buf);
+    free(res);
+    return ret < 0 ? -1 : okay;
+}
+
+// a view of the data read from the daemon (into memory allocated
+// along with the piece)
+static int remote_read_view(int fd, int offset, int size, FS_View_t* view)
+{
+    if (size > FS_MAX_DATA) size = FS_MAX_DATA;
+    if (offset < 0 || size < 0) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    struct iovec* iov = malloc(sizeof(struct iovec) + size);
+    if (!iov) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    int n = remote_call(FS_REQ_FILE_READ_VIEW, fd, size, offset, NULL, 0, (char*)(iov + 1), size);
+    if (n < 0) {
+        free(iov);
+        return -1;
+    }
+    iov->iov_base = iov + 1;
+    iov->iov_len = n;
+    view->iov = iov;
+    view->iovcnt = n > 0;
+    view->inode = 0;
+    return n;
+}
+
+static int remote_dir_next(int dd, char* name, int* inode)
+{
+    FS_Dirent_t entry;
+    int ret = remote_call(FS_REQ_DIR_NEXT, dd, 0, 0, NULL, 0, &entry, sizeof(entry));
+    if (ret > 0) {
+        if (name) memcpy(name, entry.name, MAX_NAME);
+        if (inode) *inode = entry.inode;
+    }
+    return ret;
+}
+
+int FS_Boot(char* backstore_fname)
+{
+    // use the daemon serving the disk file, if there's one
+    remote_disconnect();
+    remote_fd = remote_connect(backstore_fname);
+    if (remote_fd >= 0) return 0;
+
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_wrlock(&fs_lock);
+    int ret = boot_fs(backstore_fname, NULL);
+    pthread_rwlock_unlock(&fs_lock);
+    op_end(FS_OP_BOOT, &t);
+    return ret;
+}
+
+int FS_Format(char* backstore_fname, int sector_size, int total_sectors, int max_files)
+{
+    // never overwrite a disk file that's being served
+    remote_disconnect();
+    int fd = remote_connect(backstore_fname);
+    if (fd >= 0) {
+        dprintf("... disk file '%s' is served by a daemon\n", backstore_fname);
+        close(fd);
+        osErrno = E_FILE_IN_USE;
+        return -1;
+    }
+    superblock_t geometry;
+    geometry.sector_size = sector_size;
+    geometry.total_sectors = total_sectors;
+    geometry.max_files = max_files;
+    pthread_rwlock_wrlock(&fs_lock);
+    int ret = boot_fs(backstore_fname, &geometry);
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
+static int sync_fs()
+{
+    // only the sectors changed since boot (or the last sync) need to be
+    // written back to the backstore file, through the journal
+    if (fs_commit() < 0) {
+        // if can't write to file, something's wrong with the backstore
+        dprintf("FS_Sync():\n... failed to save disk to file '%s'\n", bs_filename);
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    else {
+        // everything's good now, sync is successful
+        dprintf("FS_Sync():\n... successfully saved disk to file '%s'\n", bs_filename);
+        return 0;
+    }
+}
+
+// the views held by this thread (see File_ReadView), each of which
+// keeps 'fs_lock' shared
+static __thread int views_held;
+
+// group commit: once enough sectors are dirty, the operation that
+// finds them so (after releasing its locks) commits the changes of all
+// operations since the last commit at once; the error of the commit
+// (if any) is not reported to the operation, it's retried next time;
+// a thread holding a view leaves the commit to the next operation of
+// another thread, as it couldn't take 'fs_lock' exclusively; while a
+// batch is open nothing is committed until the batch is, unless the
+// cache is about to fill up
+static void journal_maybe_commit()
+{
+    if (views_held > 0) return;
+    pthread_mutex_lock(&cache_lock);
+    int n = cache_dirty + __atomic_load_n(&cache_owed, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cache_lock);
+    if (n < JOURNAL_COMMIT_DIRTY) return;
+
+    pthread_rwlock_rdlock(&fs_lock);
+    int batched = batch_depth > 0;
+    pthread_rwlock_unlock(&fs_lock);
+    if (batched && n < JOURNAL_BATCH_DIRTY) return;
+
+    int err = osErrno;
+    pthread_rwlock_wrlock(&fs_lock);
+    // unless done meanwhile
+    n = cache_dirty + cache_owed;
+    if (n >= (batch_depth > 0 ? JOURNAL_BATCH_DIRTY : JOURNAL_COMMIT_DIRTY)) sync_fs();
+    pthread_rwlock_unlock(&fs_lock);
+    osErrno = err;
+}
+
+// called by an operation before it changes anything: commit if
+// enough is dirty, and fail (with osErrno set) if even so there's no
+// room left in the cache for the operation (only a thread holding a
+// view can't commit); return 0 if OK, -1 otherwise
+static int journal_make_room()
+{
+    journal_maybe_commit();
+    pthread_mutex_lock(&cache_lock);
+    int n = cache_dirty + __atomic_load_n(&cache_owed, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cache_lock);
+    if (n < CACHE_SECTORS - 2 * CACHE_RESERVE) return 0;
+    dprintf("... no room left in the cache, commit first\n");
+    osErrno = E_GENERAL;
+    return -1;
+}
+
+int FS_Sync()
+{
+    if (remote_fd >= 0) return remote_call(FS_REQ_SYNC, 0, 0, 0, NULL, 0, NULL, 0);
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_wrlock(&fs_lock);
+    int ret = sync_fs();
+    pthread_rwlock_unlock(&fs_lock);
+    op_end(FS_OP_SYNC, &t);
+    return ret;
+}
+
+int FS_BeginBatch()
+{
+    if (remote_fd >= 0) return remote_call(FS_REQ_BEGIN_BATCH, 0, 0, 0, NULL, 0, NULL, 0);
+    dprintf("FS_BeginBatch():\n");
+    pthread_rwlock_wrlock(&fs_lock);
+    batch_depth++;
+    pthread_rwlock_unlock(&fs_lock);
+    return 0;
+}
+
+int FS_CommitBatch()
+{
+    if (remote_fd >= 0) return remote_call(FS_REQ_COMMIT_BATCH, 0, 0, 0, NULL, 0, NULL, 0);
+    dprintf("FS_CommitBatch():\n");
+    pthread_rwlock_wrlock(&fs_lock);
+    int ret = 0;
+    if (batch_depth == 0) {
+        dprintf("... no batch to commit\n");
+        osErrno = E_GENERAL;
+        ret = -1;
+    }
+    else if (--batch_depth == 0) {
+        // only the outermost batch is committed
+        batch_dir_len = -1;
+        ret = sync_fs();
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
+int FS_CacheStats(int* hits, int* misses)
+{
+    if (remote_fd >= 0) {
+        int counts[2];
+        if (remote_call(FS_REQ_CACHE_STATS, 0, 0, 0, NULL, 0, counts, sizeof(counts)) < 0) return -1;
+        if (hits) *hits = counts[0];
+        if (misses) *misses = counts[1];
+        return 0;
+    }
+    pthread_mutex_lock(&cache_lock);
+    if (hits) *hits = cache_hits;
+    if (misses) *misses = cache_misses;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+int FS_GetStats(FS_Stats_t* st)
+{
+    if (!st) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    if (remote_fd >= 0) return remote_call(FS_REQ_GET_STATS, 0, 0, 0, NULL, 0, st, sizeof(*st));
+    // each counter is read atomically (some may be a little ahead of
+    // the others if the file system is busy)
+    unsigned long* from = (unsigned long*)&stats;
+    unsigned long* to = (unsigned long*)st;
+    for (int i = 0; i < sizeof(FS_Stats_t) / sizeof(unsigned long); i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    pthread_mutex_lock(&cache_lock);
+    st->cache_hits = cache_hits;
+    st->cache_misses = cache_misses;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+// the file system check: the inodes in use (as given by the inode
+// bitmap) are split among threads, each of which checks its inodes and
+// marks the sectors they use, and counts the directory entries pointing
+// to each inode; the sectors marked are then compared with the sector
+// bitmap a word at a time; all of it is read straight from the disk,
+// once the file system is synchronized
+#define CHECK_MAX_THREADS 8
+
+typedef struct _check {
+    uint64_t* inodes;  // the inode bitmap on disk
+    uint64_t* sectors; // the sector bitmap on disk
+    uint64_t* used;    // the sectors found in use (marked atomically)
+    int* links;        // the directory entries pointing to each inode
+} check_t;
+static check_t check;
+
+// the part of the check done by one thread
+typedef struct _check_part {
+    int first, last;   // the inodes to check
+    FS_Check_t found;  // and what's found
+} check_part_t;
+
+static int check_bit(uint64_t* words, int ibit)
+{
+    return (words[ibit / 64] >> (ibit % 64)) & 1;
+}
+
+// return the number of bits set in 'a' but not in 'b' among the first
+// 'nbits' bits
+static int check_missing(uint64_t* a, uint64_t* b, int nbits)
+{
+    int n = 0, nwords = nbits / 64;
+    for (int w = 0; w < nwords; w++) n += __builtin_popcountll(a[w] & ~b[w]);
+    if (nbits % 64) n += __builtin_popcountll(a[nwords] & ~b[nwords] & (((uint64_t)1 << (nbits % 64)) - 1));
+    return n;
+}
+
+// return whether 'num' sectors from 'start' are all within the data blocks
+static int check_range(int start, int num)
+{
+    return num > 0 && start >= DATABLOCK_START_SECTOR && start <= TOTAL_SECTORS - num;
+}
+
+// mark 'num' sectors from 'start' in use
+static void check_mark(check_part_t* part, int start, int num)
+{
+    for (int s = start; s < start + num; s++) {
+        uint64_t bit = (uint64_t)1 << (s % 64);
+        if (__atomic_fetch_or(&check.used[s / 64], bit, __ATOMIC_RELAXED) & bit)
+            part->found.dup_blocks++;
+    }
+    part->found.blocks += num;
+}
+
+// check the directory entries of the directory 'dir'
+static void check_dirents(check_part_t* part, inode_t* dir, extent_t* ext)
+{
+    int pos = 0;
+    for (int e = 0; e < dir->nextents && pos < dir->size; e++)
+        for (int b = 0; b < ext[e].length && pos < dir->size; b++) {
+            dirent_t* d = (dirent_t*)Disk_View(ext[e].start + b, 1);
+            for (int j = 0; j < (int)DIRENTS_PER_SECTOR && pos < dir->size; j++, pos++) {
+                int child = d[j].inode;
+                if (!d[j].fname[0] || !memchr(d[j].fname, '\0', MAX_NAME) || child <= 0 ||
+                    child >= MAX_FILES || !check_bit(check.inodes, child))
+                    part->found.bad_entries++;
+                else __atomic_fetch_add(&check.links[child], 1, __ATOMIC_RELAXED);
+            }
+        }
+}
+
+// check the inode (which is in use); return 0 if it's good, -1 if not
+static int check_inode(check_part_t* part, int i)
+{
+    inode_t in;
+    const char* sector = Disk_View(INODE_TABLE_START_SECTOR + i / INODES_PER_SECTOR, 1);
+    memcpy(&in, sector + (i % INODES_PER_SECTOR) * sizeof(inode_t), sizeof(inode_t));
+    if ((in.type != 0 && in.type != 1) || in.size < 0 || in.nextents < 0 ||
+        in.nextents > MAX_EXTENTS_PER_FILE || (i == 0 && in.type != 1))
+        return -1;
+    if (INODE_INLINE(&in)) return (in.nextents == 0 && in.size <= INLINE_DATA_SIZE) ? 0 : -1;
+    if (in.nextents > INODE_EXTENTS && !check_range(in.indirect, 1)) return -1;
+
+    // all the extents are checked before any sector is marked
+    extent_t ext[MAX_EXTENTS_PER_FILE];
+    memcpy(ext, in.extent, sizeof(in.extent));
+    if (in.nextents > INODE_EXTENTS)
+        memcpy(&ext[INODE_EXTENTS], Disk_View(in.indirect, 1),
+            (in.nextents - INODE_EXTENTS) * sizeof(extent_t));
+    long blocks = 0;
+    for (int e = 0; e < in.nextents; e++) {
+        if (!check_range(ext[e].start, ext[e].length)) return -1;
+        blocks += ext[e].length;
+    }
+    long need = in.type == 1 ? (long)in.size * sizeof(dirent_t) : in.size;
+    if (blocks != in.blocks || need > blocks * SECTOR_SIZE) return -1;
+    int nindex = (in.type == 1 && in.index > 0) ? index_sectors(in.blocks) : 0;
+    if (nindex > 0 && !check_range(in.index, nindex)) return -1;
+
+    for (int e = 0; e < in.nextents; e++) check_mark(part, ext[e].start, ext[e].length);
+    if (in.nextents > INODE_EXTENTS) check_mark(part, in.indirect, 1);
+    if (nindex > 0) check_mark(part, in.index, nindex);
+    if (in.type == 1) check_dirents(part, &in, ext);
+    return 0;
+}
+
+static void* check_thread(void* arg)
+{
+    check_part_t* part = arg;
+    for (int i = part->first; i < part->last; i++) {
+        if (!check_bit(check.inodes, i)) continue;
+        part->found.inodes++;
+        if (check_inode(part, i) < 0) {
+            dprintf("... inode %d is bad\n", i);
+            part->found.bad_inodes++;
+        }
+    }
+    return NULL;
+}
+
+static int check_fs(FS_Check_t* found)
+{
+    dprintf("FS_Check():\n");
+    memset(found, 0, sizeof(*found));
+    if (sync_fs() < 0) return -1;
+
+    int inode_words = INODE_BITMAP_SECTORS * SECTOR_SIZE / 8;
+    int sector_words = SECTOR_BITMAP_SECTORS * SECTOR_SIZE / 8;
+    check.inodes = malloc(inode_words * sizeof(uint64_t));
+    check.sectors = malloc(sector_words * sizeof(uint64_t));
+    check.used = calloc(sector_words, sizeof(uint64_t));
+    check.links = calloc(MAX_FILES, sizeof(int));
+    int ret = -1;
+    if (!check.inodes || !check.sectors || !check.used || !check.links ||
+        bits_load(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, check.inodes) < 0 ||
+        bits_load(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, check.sectors) < 0) {
+        osErrno = E_GENERAL;
+        goto done;
+    }
+
+    // a thread for each processor (up to a few), unless there are few
+    // inodes to check
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > CHECK_MAX_THREADS) nthreads = CHECK_MAX_THREADS;
+    if (nthreads > MAX_FILES / 1024) nthreads = MAX_FILES / 1024;
+    if (nthreads < 1) nthreads = 1;
+    check_part_t part[CHECK_MAX_THREADS];
+    pthread_t threads[CHECK_MAX_THREADS];
+    memset(part, 0, sizeof(part));
+    for (int t = 0; t < nthreads; t++) {
+        part[t].first = (long)MAX_FILES * t / nthreads;
+        part[t].last = (long)MAX_FILES * (t + 1) / nthreads;
+    }
+    int started = 1;
+    while (started < nthreads && pthread_create(&threads[started], NULL, check_thread, &part[started]) == 0)
+        started++;
+    for (int t = started; t < nthreads; t++) check_thread(&part[t]); // couldn't start them
+    check_thread(&part[0]);
+    for (int t = 1; t < started; t++) pthread_join(threads[t], NULL);
+    for (int t = 0; t < nthreads; t++) {
+        found->inodes += part[t].found.inodes;
+        found->blocks += part[t].found.blocks;
+        found->bad_inodes += part[t].found.bad_inodes;
+        found->dup_blocks += part[t].found.dup_blocks;
+        found->bad_entries += part[t].found.bad_entries;
+    }
+
+    // the sectors before the data blocks are always in use
+    if (!check_bit(check.inodes, 0)) found->bad_inodes++; // no root directory
+    for (int s = 0; s < DATABLOCK_START_SECTOR; s++) check.used[s / 64] |= (uint64_t)1 << (s % 64);
+    found->lost_blocks = check_missing(check.used, check.sectors, TOTAL_SECTORS);
+    found->leaked_blocks = check_missing(check.sectors, check.used, TOTAL_SECTORS);
+    for (int i = 1; i < MAX_FILES; i++) {
+        if (!check_bit(check.inodes, i)) continue;
+        if (check.links[i] == 0) found->orphans++;
+        else if (check.links[i] > 1) found->extra_links++;
+    }
+    ret = found->bad_inodes + found->dup_blocks + found->lost_blocks + found->leaked_blocks +
+        found->bad_entries + found->orphans + found->extra_links;
+    dprintf("... %d problems found\n", ret);
+
+done:
+    free(check.inodes);
+    free(check.sectors);
+    free(check.used);
+    free(check.links);
+    memset(&check, 0, sizeof(check));
+    return ret;
+}
+
+int FS_Check(FS_Check_t* found)
+{
+    if (!found) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    if (remote_fd >= 0) return remote_call(FS_REQ_CHECK, 0, 0, 0, NULL, 0, found, sizeof(*found));
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_wrlock(&fs_lock);
+    int ret = check_fs(found);
+    pthread_rwlock_unlock(&fs_lock);
+    op_end(FS_OP_CHECK, &t);
+    return ret;
+}
+
+// the snapshots being saved in the background, one for each disk
+// snapshot; they outlive a reboot, as the disk copies the sectors the
+// snapshots still share before it's replaced
+typedef struct {
+    int busy;         // the snapshot is taken (and not waited for yet)
+    int waiting;      // someone is waiting for it
+    pthread_t thread; // the thread saving it
+    int result;       // what Disk_SaveSnapshot() returned
+    char* file;       // the file it's saved to
+} export_t;
+
+static export_t exports[DISK_MAX_SNAPSHOTS];
+
+static void* export_snapshot(void* arg)
+{
+    int snap = (int)(intptr_t)arg;
+    int ret = Disk_SaveSnapshot(snap, exports[snap].file);
+    if (ret < 0) dprintf("... failed to save snapshot %d (diskErrno=%d)\n", snap, diskErrno);
+    exports[snap].result = ret;
+    return NULL;
+}
+
+int FS_Snapshot(char* file)
+{
+    if (remote_fd >= 0) return remote_path(FS_REQ_SNAPSHOT, file);
+    dprintf("FS_Snapshot('%s'):\n", file);
+    if (!file) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    char* name = strdup(file);
+    if (!name) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    // the snapshot is taken once everything is synchronized, with no
+    // one writing meanwhile; it's saved without blocking anyone
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_wrlock(&fs_lock);
+    int snap = sync_fs() < 0 ? -1 : Disk_Snapshot();
+    pthread_rwlock_unlock(&fs_lock);
+    if (snap < 0) {
+        dprintf("... failed to take snapshot\n");
+        osErrno = E_GENERAL;
+    }
+    else {
+        pthread_mutex_lock(&export_lock);
+        export_t* e = &exports[snap];
+        e->busy = 1;
+        e->waiting = 0;
+        e->file = name;
+        e->result = -1;
+        if (pthread_create(&e->thread, NULL, export_snapshot, (void*)(intptr_t)snap) != 0) {
+            dprintf("... failed to start saving snapshot\n");
+            e->busy = 0;
+            Disk_ReleaseSnapshot(snap);
+            osErrno = E_GENERAL;
+            snap = -1;
+        }
+        pthread_mutex_unlock(&export_lock);
+    }
+    if (snap < 0) free(name);
+    op_end(FS_OP_SNAPSHOT, &t);
+    return snap;
+}
+
+int FS_SnapshotWait(int snapshot)
+{
+    if (remote_fd >= 0) return remote_call(FS_REQ_SNAPSHOT_WAIT, snapshot, 0, 0, NULL, 0, NULL, 0);
+    dprintf("FS_SnapshotWait(%d):\n", snapshot);
+    pthread_mutex_lock(&export_lock);
+    if (snapshot < 0 || snapshot >= DISK_MAX_SNAPSHOTS ||
+        !exports[snapshot].busy || exports[snapshot].waiting) {
+        pthread_mutex_unlock(&export_lock);
+        dprintf("... no such snapshot\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    export_t* e = &exports[snapshot];
+    e->waiting = 1;
+    pthread_mutex_unlock(&export_lock);
+
+    pthread_join(e->thread, NULL);
+    int ret = e->result;
+    free(e->file);
+
+    // the number can be taken again once the disk snapshot is released
+    pthread_mutex_lock(&export_lock);
+    Disk_ReleaseSnapshot(snapshot);
+    e->busy = 0;
+    pthread_mutex_unlock(&export_lock);
+    if (ret < 0) osErrno = E_GENERAL;
+    return ret;
+}
+
+int File_Create(char* file)
+{
+    if (remote_fd >= 0) return remote_path(FS_REQ_FILE_CREATE, file);
+    dprintf("File_Create('%s'):\n", file);
+    if (journal_make_room() < 0) return -1;
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_wrlock(&ns_lock);
+    int ret = create_file_or_directory(0, file);
+    pthread_rwlock_unlock(&ns_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    journal_maybe_commit();
+    op_end(FS_OP_FILE_CREATE, &t);
+    return ret;
+}
+
+// run 'op' on each of the 'n' paths in one batch; the result of each
+// path (0 if successful, the error code otherwise) is stored in
+// 'results' (unless it's NULL); return the number of successful ones,
+// or -1 if the batch couldn't be committed
+static int batch_paths(int (*op)(char*), char** paths, int n, int* results)
+{
+    int okay = 0;
+    FS_BeginBatch();
+    for (int i = 0; i < n; i++) {
+        int ret = op(paths[i]);
+        if (ret == 0) okay++;
+        if (results) results[i] = (ret == 0) ? 0 : osErrno;
+    }
+    if (FS_CommitBatch() < 0) return -1;
+    return okay;
+}
+
+int File_CreateMany(char** paths, int n, int* results)
+{
+    if (remote_fd >= 0) return remote_many(FS_REQ_CREATE_MANY, paths, n, results);
+    dprintf("File_CreateMany(%d):\n", n);
+    return batch_paths(File_Create, paths, n, results);
+}
+
+int File_UnlinkMany(char** paths, int n, int* results)
+{
+    if (remote_fd >= 0) return remote_many(FS_REQ_UNLINK_MANY, paths, n, results);
+    dprintf("File_UnlinkMany(%d):\n", n);
+    return batch_paths(File_Unlink, paths, n, results);
+}
+
+static int unlink_file(char* file)
+{
+    dprintf("FS_Unlink('%s'):\n", file);
 
     int child_inode;
-    int parent_inode = follow_path(file, &child_inode, NULL);
+    char last_fname[MAX_NAME];
+    int parent_inode = follow_path(file, &child_inode, last_fname);
     if (parent_inode >= 0) {
         if (child_inode >= 0) {
             dprintf("... file '%s' exists: parent_inode=%d, child_inode=%d\n",
@@ -748,7 +3376,7 @@ int File_Unlink(char* file)
                 osErrno = E_FILE_IN_USE;
                 return -1;
             }
-            int ret = remove_inode(0, parent_inode, child_inode);
+            int ret = remove_inode(0, parent_inode, child_inode, last_fname);
             if (ret >= 0) {
                 dprintf("... successfully deleted file: '%s'\n", file);
                 return 0;
@@ -772,23 +3400,32 @@ int File_Unlink(char* file)
     }
 }
 
-int File_Open(char* file)
+int File_Unlink(char* file)
 {
-    dprintf("File_Open('%s'):\n", file);
-    int fd = new_file_fd();
-    if (fd < 0) {
-        dprintf("... max open files reached\n");
-        osErrno = E_TOO_MANY_OPEN_FILES;
-        return -1;
-    }
+    if (remote_fd >= 0) return remote_path(FS_REQ_FILE_UNLINK, file);
+    if (journal_make_room() < 0) return -1;
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_wrlock(&ns_lock);
+    int ret = unlink_file(file);
+    pthread_rwlock_unlock(&ns_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    journal_maybe_commit();
+    op_end(FS_OP_FILE_UNLINK, &t);
+    return ret;
+}
 
-    int child_inode;
+static int open_file(char* file)
+{
+    dprintf("File_Open('%s'):\n", file);
+    int child_inode = -1; // not set if the path can't be followed
     follow_path(file, &child_inode, NULL);
     if (child_inode >= 0) { // child is the one
       // load the disk sector containing the inode
         int inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
         char inode_buffer[SECTOR_SIZE];
-        if (Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+        if (cache_read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
         dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
 
         // get the inode
@@ -804,231 +3441,463 @@ int File_Open(char* file)
             osErrno = E_GENERAL;
             return -1;
         }
-
-        // initialize open file entry and return its index
-        open_files[fd].inode = child_inode;
-        open_files[fd].size = child->size;
-        open_files[fd].pos = 0;
-        return fd;
-    }
-    else {
-        dprintf("... file '%s' is not found\n", file);
-        osErrno = E_NO_SUCH_FILE;
-        return -1;
+
+        // initialize open file entry and return its index; the inode
+        // is loaded (again) if the file isn't already open, since it
+        // may have been written back after we looked at it
+        pthread_mutex_lock(&fd_lock);
+        int fd = new_file_fd(child_inode);
+        if (fd >= 0) {
+            open_files[fd].pos = 0;
+            if (open_count[child_inode] == 1 && load_open_inode(child_inode) < 0) {
+                free_file_fd(fd);
+                fd = -2;
+            }
+        }
+        pthread_mutex_unlock(&fd_lock);
+        if (fd == -1) {
+            dprintf("... max open files reached\n");
+            osErrno = E_TOO_MANY_OPEN_FILES;
+        }
+        else if (fd < 0) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        return fd;
+    }
+    else {
+        dprintf("... file '%s' is not found\n", file);
+        osErrno = E_NO_SUCH_FILE;
+        return -1;
+    }
+}
+
+int File_Open(char* file)
+{
+    if (remote_fd >= 0) return remote_path(FS_REQ_FILE_OPEN, file);
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_rdlock(&ns_lock);
+    int ret = open_file(file);
+    pthread_rwlock_unlock(&ns_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    op_end(FS_OP_FILE_OPEN, &t);
+    return ret;
+}
+
+int File_Read(int fd, void* buffer, int size)
+{
+    if (remote_fd >= 0) return remote_read(fd, buffer, size, -1);
+    dprintf("File_Read(fd=%d,size=%d):\n", fd, size);
+    if (check_open_file(fd) < 0) return -1;
+    open_file_t* of = &open_files[fd];
+    pthread_mutex_lock(&of->pos_lock);
+    int ret = File_PRead(fd, buffer, size, of->pos);
+    if (ret > 0) of->pos += ret;
+    pthread_mutex_unlock(&of->pos_lock);
+    return ret;
+}
+
+static int pwrite_file(int fd, struct iovec* iov, int iovcnt, int offset);
+
+int File_Write(int fd, void* buffer, int size)
+{
+    if (remote_fd >= 0) return remote_write(fd, buffer, size, -1);
+    dprintf("File_Write(fd=%d,size=%d):\n", fd, size);
+    if (check_open_file(fd) < 0) return -1;
+    if (journal_make_room() < 0) return -1;
+    op_timer_t t;
+    op_begin(&t);
+    struct iovec iov = { buffer, size };
+    open_file_t* of = &open_files[fd];
+    pthread_mutex_lock(&of->pos_lock);
+    int ret = pwrite_file(fd, &iov, 1, of->pos);
+    if (ret > 0) of->pos += ret;
+    pthread_mutex_unlock(&of->pos_lock);
+    journal_maybe_commit(); // not holding the position, see File_WriteV
+    op_end(FS_OP_FILE_WRITE, &t);
+    return ret;
+}
+
+int File_PRead(int fd, void* buffer, int size, int offset)
+{
+    if (remote_fd >= 0) return remote_read(fd, buffer, size, offset);
+    struct iovec iov = { buffer, size };
+    return File_ReadV(fd, &iov, 1, offset);
+}
+
+int File_PWrite(int fd, void* buffer, int size, int offset)
+{
+    if (remote_fd >= 0) return remote_write(fd, buffer, size, offset);
+    struct iovec iov = { buffer, size };
+    return File_WriteV(fd, &iov, 1, offset);
+}
+
+static int read_file(int fd, struct iovec* iov, int iovcnt, int offset)
+{
+    dprintf("File_ReadV(fd=%d,iovcnt=%d,offset=%d):\n", fd, iovcnt, offset);
+    if (check_open_file(fd) < 0) return -1;
+    if (check_iovec(iov, iovcnt, offset) < 0) return -1;
+    inode_t* inode = &open_inodes[open_files[fd].inode];
+    pending_t* pending = &open_pending[open_files[fd].inode];
+    int size = open_file_size(open_files[fd].inode);
+    dprintf("... file offset=%d, file size=%d\n", offset, size);
+
+    // if we have reached the end of file, there isn't really
+    // anthing we need to do
+    if (offset >= size) return 0;
+
+    // reading on from where the last read ended means the file is
+    // read sequentially and the read-ahead window is opened (or kept
+    // open); anything else closes it
+    open_file_t* of = &open_files[fd];
+    pthread_mutex_lock(&of->ra_lock);
+    if (offset != of->ra_next) of->ra_window = 0;
+    else if (of->ra_window == 0) of->ra_window = RA_MIN_BLOCKS;
+
+    // fill the buffers one after another (from disk, and then from the
+    // pending data)
+    int pos = offset;
+    for (int i = 0; i < iovcnt; i++) {
+        int n = read_data(inode, of, iov[i].iov_base, iov[i].iov_len, pos);
+        if (n < 0) {
+            pthread_mutex_unlock(&of->ra_lock);
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        if (n < (int)iov[i].iov_len && pos + n < size) {
+            int m = size - (pos + n);
+            if (m > (int)iov[i].iov_len - n) m = iov[i].iov_len - n;
+            memcpy((char*)iov[i].iov_base + n, pending->buf + (pos + n - inode->size), m);
+            n += m;
+        }
+        pos += n;
+        if (n < (int)iov[i].iov_len) break; // end of file
     }
+    of->ra_next = pos;
+    pthread_mutex_unlock(&of->ra_lock);
+    return pos - offset;
 }
 
-int File_Read(int fd, void* buffer, int size)
+int File_ReadV(int fd, struct iovec* iov, int iovcnt, int offset)
 {
-    dprintf("File_Read(fd=%d,size=%d):\n", fd, size);
-    if (0 > fd || fd > MAX_OPEN_FILES) {
-        dprintf("... fd=%d out of bound\n", fd);
-        osErrno = E_BAD_FD;
-        return -1;
-    }
-    if (open_files[fd].inode <= 0) {
-        dprintf("... fd=%d not an open file\n", fd);
-        osErrno = E_BAD_FD;
-        return -1;
+    if (remote_fd >= 0) return remote_readv(fd, iov, iovcnt, offset);
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = -1;
+    if (check_open_file(fd) == 0) {
+        int inode = open_files[fd].inode;
+        pthread_rwlock_rdlock(&inode_locks[inode]);
+        ret = read_file(fd, iov, iovcnt, offset);
+        pthread_rwlock_unlock(&inode_locks[inode]);
     }
-    if (!buffer || size < 0) {
-        dprintf("... invalid buffer or size parameter\n");
+    pthread_rwlock_unlock(&fs_lock);
+    op_end(FS_OP_FILE_READ, &t);
+    return ret;
+}
+
+// point the view at up to 'size' bytes of the open file starting from
+// 'offset', which are all on disk; the caller holds the inode lock
+// shared; return the number of bytes in the view, or -1 (with osErrno
+// set) if there's error
+static int read_view(int fd, int offset, int size, FS_View_t* view)
+{
+    dprintf("File_ReadView(fd=%d,offset=%d,size=%d):\n", fd, offset, size);
+    if (offset < 0 || size < 0) {
+        dprintf("... invalid offset or size parameter\n");
         osErrno = E_GENERAL;
         return -1;
     }
-    dprintf("... file offset=%d, file size=%d\n",
-        open_files[fd].pos, open_files[fd].size);
-
-    // if we have reached the end of file or the read size is zero,
-    // there isn't really anthing we need to do
-    if (open_files[fd].pos == open_files[fd].size || size == 0)
-        return 0;
+    inode_t* inode = &open_inodes[open_files[fd].inode];
+    if (offset >= inode->size) return 0;
+    if (size > inode->size - offset) size = inode->size - offset;
 
-    // load the disk sector containing the inode
-    int inode_sector = INODE_TABLE_START_SECTOR + open_files[fd].inode / INODES_PER_SECTOR;
-    char inode_buffer[SECTOR_SIZE];
-    if (Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
-    dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
+    // the data of a small file is in its inode (the open one, which is
+    // up to date)
+    if (INODE_INLINE(inode)) {
+        view->iov = malloc(sizeof(struct iovec));
+        if (!view->iov) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        view->iov[0].iov_base = inode->data + offset;
+        view->iov[0].iov_len = size;
+        view->iovcnt = 1;
+        return size;
+    }
 
-    // get the inode
-    int inode_start_entry = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-    int offset = open_files[fd].inode - inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t* inode = (inode_t*)(inode_buffer + offset * sizeof(inode_t));
-    dprintf("... inode %d (size=%d, type=%d)\n", open_files[fd].inode,
-        inode->size, inode->type);
-    assert(inode->size == open_files[fd].size);
-    assert(inode->type == 0);
-
-    // calculate the necessary range to read in (less than a sector)
-    int gidx = open_files[fd].pos / SECTOR_SIZE;
-    int start_addr = gidx * SECTOR_SIZE;
-    int end_addr = start_addr + SECTOR_SIZE;
-    if (end_addr > inode->size) end_addr = inode->size;
-    if (end_addr < open_files[fd].pos + size)
-        size = end_addr - open_files[fd].pos;
-    offset = open_files[fd].pos - start_addr;
-
-    // load in the data block and copy data
-    char data[SECTOR_SIZE];
-    if (Disk_Read(inode->data[gidx], data) < 0) { osErrno = E_GENERAL; return -1; }
-    dprintf("... load data from group %d disk sector %d (data range=%d..%d)\n",
-        gidx, inode->data[gidx], start_addr, end_addr);
-    memcpy(buffer, &data[offset], size);
-    open_files[fd].pos += size;
-    dprintf("... copied data from %d to %d of size %d, new pos=%d\n",
-        start_addr + offset, start_addr + offset + size, size, open_files[fd].pos);
+    // one piece for each extent (the ones next to each other on disk
+    // are merged)
+    int max = 0, pos = offset, remain = size;
+    while (remain > 0) {
+        int gidx = pos / SECTOR_SIZE;
+        int off = pos - gidx * SECTOR_SIZE;
+        int run;
+        int sector = map_block(inode, gidx, &run);
+        int n = run * SECTOR_SIZE - off;
+        if (n > remain) n = remain;
+        const char* data = sector < 0 ? NULL : Disk_View(sector, (off + n + SECTOR_SIZE - 1) / SECTOR_SIZE);
+        if (!data) {
+            free(view->iov);
+            view->iov = NULL;
+            view->iovcnt = 0;
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        struct iovec* last = view->iovcnt ? &view->iov[view->iovcnt - 1] : NULL;
+        if (last && (char*)last->iov_base + last->iov_len == data + off)
+            last->iov_len += n;
+        else {
+            if (view->iovcnt == max) {
+                max = max ? 2 * max : 8;
+                struct iovec* iov = realloc(view->iov, max * sizeof(struct iovec));
+                if (!iov) {
+                    free(view->iov);
+                    view->iov = NULL;
+                    view->iovcnt = 0;
+                    osErrno = E_GENERAL;
+                    return -1;
+                }
+                view->iov = iov;
+            }
+            view->iov[view->iovcnt].iov_base = (char*)data + off;
+            view->iov[view->iovcnt].iov_len = n;
+            view->iovcnt++;
+        }
+        pos += n; remain -= n;
+    }
+    dprintf("... %d bytes in %d pieces\n", size, view->iovcnt);
     return size;
 }
 
-int File_Write(int fd, void* buffer, int size)
+int File_ReadView(int fd, int offset, int size, FS_View_t* view)
 {
-    dprintf("File_Write(fd=%d,size=%d):\n", fd, size);
-    if (0 > fd || fd > MAX_OPEN_FILES) {
-        dprintf("... fd=%d out of bound\n", fd);
-        osErrno = E_BAD_FD;
-        return -1;
-    }
-    if (open_files[fd].inode <= 0) {
-        dprintf("... fd=%d not an open file\n", fd);
-        osErrno = E_BAD_FD;
-        return -1;
-    }
-    if (!buffer || size < 0) {
-        dprintf("... invalid buffer or size parameter\n");
+    op_timer_t t;
+    op_begin(&t);
+    if (!view) {
         osErrno = E_GENERAL;
+        op_end(FS_OP_FILE_READVIEW, &t);
         return -1;
     }
-    dprintf("... file offset=%d, file size=%d\n",
-        open_files[fd].pos, open_files[fd].size);
+    view->iov = NULL;
+    view->iovcnt = 0;
+    view->inode = -1;
+    if (remote_fd >= 0) {
+        int ret = remote_read_view(fd, offset, size, view);
+        op_end(FS_OP_FILE_READVIEW, &t);
+        return ret;
+    }
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = -1;
+    if (check_open_file(fd) == 0) {
+        int inode = open_files[fd].inode;
+        pthread_rwlock_rdlock(&inode_locks[inode]);
 
-    // if write size is zero, there isn't really anthing we need to do
-    if (size == 0) return 0;
+        // the data still pending is written first, so that the view
+        // points only at the disk
+        int flushed = 0;
+        while (flushed == 0 && open_pending[inode].len > 0
+               && size > open_inodes[inode].size - offset) {
+            pthread_rwlock_unlock(&inode_locks[inode]);
+            pthread_rwlock_wrlock(&inode_locks[inode]);
+            if (flush_pending(inode) < 0) {
+                osErrno = E_GENERAL;
+                flushed = -1;
+            }
+            pthread_rwlock_unlock(&inode_locks[inode]);
+            pthread_rwlock_rdlock(&inode_locks[inode]);
+        }
+        if (flushed == 0) ret = read_view(fd, offset, size, view);
 
-    // load the disk sector containing the inode
-    int inode_sector = INODE_TABLE_START_SECTOR + open_files[fd].inode / INODES_PER_SECTOR;
-    char inode_buffer[SECTOR_SIZE];
-    if (Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
-    dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
+        // the locks are kept until the view is released
+        if (ret >= 0) {
+            view->inode = inode;
+            views_held++;
+        }
+        else pthread_rwlock_unlock(&inode_locks[inode]);
+    }
+    if (ret < 0) pthread_rwlock_unlock(&fs_lock);
+    op_end(FS_OP_FILE_READVIEW, &t);
+    return ret;
+}
 
-    // get the inode
-    int inode_start_entry = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-    int offset = open_files[fd].inode - inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t* inode = (inode_t*)(inode_buffer + offset * sizeof(inode_t));
-    dprintf("... inode %d (size=%d, type=%d)\n", open_files[fd].inode,
-        inode->size, inode->type);
-    assert(inode->size == open_files[fd].size);
-    assert(inode->type == 0);
+int File_ReleaseView(FS_View_t* view)
+{
+    if (!view || view->inode < 0) {
+        dprintf("... not a view\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    free(view->iov);
+    view->iov = NULL;
+    view->iovcnt = 0;
+    if (remote_fd < 0) {
+        pthread_rwlock_unlock(&inode_locks[view->inode]);
+        pthread_rwlock_unlock(&fs_lock);
+        views_held--;
+    }
+    view->inode = -1;
+    journal_maybe_commit(); // what was left to commit while the view was held
+    return 0;
+}
 
-    // write one sector at a time
-    int bidx = 0, remain = size;
-    //dprintf("bidx=%d, remain=%d, size=%d, pos=%d\n", bidx, remain, size, open_files[fd].pos);
-    while (remain > 0) {
-        int gidx = open_files[fd].pos / SECTOR_SIZE;
-        if (gidx == MAX_SECTORS_PER_FILE) {
-            // this sort of in-the-middle handling may cause inconsistencies
-            dprintf("... error: file too big, no more data blocks for the file\n");
-            osErrno = E_FILE_TOO_BIG;
-            return -1;
-        }
-        int start_addr = gidx * SECTOR_SIZE;
-        int end_addr = start_addr + SECTOR_SIZE;
-        if (end_addr < open_files[fd].pos + size)
-            size = end_addr - open_files[fd].pos;
-        offset = open_files[fd].pos - start_addr;
-        //printf("gidx=%d, start_addr=%d, end_addr=%d, size=%d, offset=%d\n", gidx, start_addr, end_addr, size, offset);
+static int write_file(int fd, struct iovec* iov, int iovcnt, int offset)
+{
+    dprintf("File_WriteV(fd=%d,iovcnt=%d,offset=%d):\n", fd, iovcnt, offset);
+    if (check_open_file(fd) < 0) return -1;
+    if (check_iovec(iov, iovcnt, offset) < 0) return -1;
+    int inode = open_files[fd].inode;
+    dprintf("... file offset=%d, file size=%d\n", offset, open_file_size(inode));
 
-        char data[SECTOR_SIZE];
-        if (start_addr < open_files[fd].size) {
-            // if the pointer is still in allocated data blocks, load from disk
-            if (Disk_Read(inode->data[gidx], data) < 0) { osErrno = E_GENERAL; return -1; }
-            dprintf("... load data from group %d disk sector %d (data range=%d..%d)\n",
-                gidx, inode->data[gidx], start_addr, end_addr);
-        }
-        else {
-            // the pointer has moved beyond allocated blocks, crate new sector
-            int newsec = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-            if (newsec < 0) {
-                // this sort of in-the-middle handling may cause inconsistencies
-                dprintf("... error: disk is full\n");
-                osErrno = E_NO_SPACE;
-                return -1;
-            }
-            inode->data[gidx] = newsec;
-            memset(data, 0, SECTOR_SIZE);
-            dprintf("... new disk sector %d group %d (data range=%d..%d)\n",
-                newsec, gidx, start_addr, end_addr);
-        }
+    // we don't allow holes in the file
+    if (offset > open_file_size(inode)) {
+        dprintf("... offset=%d beyond end of file\n", offset);
+        osErrno = E_SEEK_OUT_OF_BOUNDS;
+        return -1;
+    }
 
-        // copy data, and move pointers
-        memcpy(&data[offset], &buffer[bidx], size);
-        dprintf("... copied data from %d to %d of size %d, new pos=%d\n",
-            start_addr + offset, start_addr + offset + size, size, open_files[fd].pos + size);
-        open_files[fd].pos += size; bidx += size; remain -= size; size = remain;
-        //printf("pos=%d, bidx=%d, remain=%d, size=%d\n", open_files[fd].pos, bidx, remain, size);
+    // write the buffers one after another
+    int pos = offset, ret = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        int n = write_pending(inode, iov[i].iov_base, iov[i].iov_len, pos);
+        if (n < 0) { ret = -1; break; } // osErrno already set
+        pos += n;
+    }
 
-        // update disk of the data block
-        if (Disk_Write(inode->data[gidx], data) < 0) { osErrno = E_GENERAL; return -1; }
-        dprintf("... update disk sector %d\n", inode->data[gidx]);
+    // the inode is written back later (it changes even if we failed in
+    // the middle, since new blocks may have been allocated)
+    if (pos > offset || ret < 0) {
+        set_inode_dirty(inode, 1);
+        open_inode_gen[inode]++;
     }
+    return ret < 0 ? ret : pos - offset;
+}
 
-    // written beyond origin file boundary, update inode
-    if (open_files[fd].pos > open_files[fd].size) {
-        open_files[fd].size = inode->size = open_files[fd].pos;
-        if (Disk_Write(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
-        dprintf("... update inode table on disk sector %d\n", inode_sector);
+// write the file under its inode lock, without committing
+static int pwrite_file(int fd, struct iovec* iov, int iovcnt, int offset)
+{
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = -1;
+    if (check_open_file(fd) == 0) {
+        int inode = open_files[fd].inode;
+        pthread_rwlock_wrlock(&inode_locks[inode]);
+        ret = write_file(fd, iov, iovcnt, offset);
+        pthread_rwlock_unlock(&inode_locks[inode]);
     }
-    return bidx;
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
+// the commit (if any) is made once the write is done, holding no lock,
+// as it waits for all the other calls to end
+int File_WriteV(int fd, struct iovec* iov, int iovcnt, int offset)
+{
+    if (remote_fd >= 0) return remote_writev(fd, iov, iovcnt, offset);
+    if (journal_make_room() < 0) return -1;
+    op_timer_t t;
+    op_begin(&t);
+    int ret = pwrite_file(fd, iov, iovcnt, offset);
+    journal_maybe_commit();
+    op_end(FS_OP_FILE_WRITE, &t);
+    return ret;
 }
 
 int File_Seek(int fd, int offset)
 {
-    if (is_file_open(open_files[fd].inode) <= 0)//Error openning the file
-    {
-        osErrno = E_BAD_FD;
-        return -1;
-    }
-    if (fd > 0 || fd > MAX_OPEN_FILES)
-    {
-        osErrno = E_GENERAL;
+    if (remote_fd >= 0) return remote_call(FS_REQ_FILE_SEEK, fd, offset, 0, NULL, 0, NULL, 0);
+    if (check_open_file(fd) < 0)//Error openning the file
         return -1;
-    }
-    if (open_files[fd].size < offset || offset < 0)//Error with the size
+    if (open_file_size(open_files[fd].inode) < offset || offset < 0)//Error with the size
     {
         osErrno = E_SEEK_OUT_OF_BOUNDS;
         return -1;
     }
+    pthread_mutex_lock(&open_files[fd].pos_lock);
     open_files[fd].pos = offset;//update location/position of the file
-    return open_files[fd].pos;
+    pthread_mutex_lock(&open_files[fd].ra_lock);
+    open_files[fd].ra_next = offset; // read-ahead starts over
+    open_files[fd].ra_window = 0;
+    pthread_mutex_unlock(&open_files[fd].ra_lock);
+    pthread_mutex_unlock(&open_files[fd].pos_lock);
+    return offset;
 }
 
 int File_Close(int fd)
 {
+    if (remote_fd >= 0) return remote_call(FS_REQ_FILE_CLOSE, fd, 0, 0, NULL, 0, NULL, 0);
     dprintf("File_Close(%d):\n", fd);
-    if (0 > fd || fd > MAX_OPEN_FILES) {
-        dprintf("... fd=%d out of bound\n", fd);
-        osErrno = E_BAD_FD;
-        return -1;
-    }
-    if (open_files[fd].inode <= 0) {
-        dprintf("... fd=%d not an open file\n", fd);
-        osErrno = E_BAD_FD;
-        return -1;
-    }
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&fd_lock);
+    int ret = check_open_file(fd);
+    int inode = ret == 0 ? open_files[fd].inode : 0;
+    pthread_mutex_unlock(&fd_lock);
+    if (ret == 0) {
+        // the file is written back under its inode lock, which comes
+        // before 'fd_lock'; the descriptor may have been closed (and
+        // even reused) meanwhile
+        pthread_rwlock_wrlock(&inode_locks[inode]);
+        pthread_mutex_lock(&fd_lock);
+        int valid = check_open_file(fd) == 0 && open_files[fd].inode == inode;
+        int last = valid && open_count[inode] == 1;
+        pthread_mutex_unlock(&fd_lock);
+        if (!valid) {
+            osErrno = E_BAD_FD;
+            ret = -1;
+        }
 
-    dprintf("... file closed successfully\n");
-    open_files[fd].inode = 0;
-    return 0;
+        // the last one to close the file writes back its pending data
+        // and its inode; the descriptor is released even if that fails
+        if (last) {
+            if (flush_pending(inode) < 0) ret = -1;
+            if (open_inode_dirty[inode]) {
+                if (cache_write_inode(inode, &open_inodes[inode], 1) < 0) {
+                    osErrno = E_GENERAL;
+                    ret = -1;
+                }
+                else set_inode_dirty(inode, 0);
+            }
+        }
+        if (valid) {
+            pthread_mutex_lock(&fd_lock);
+            free_file_fd(fd);
+            if (open_count[inode] == 0) {
+                free(open_pending[inode].buf);
+                open_pending[inode].buf = NULL;
+                open_pending[inode].cap = 0;
+            }
+            pthread_mutex_unlock(&fd_lock);
+            dprintf("... file closed\n");
+        }
+        pthread_rwlock_unlock(&inode_locks[inode]);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    journal_maybe_commit();
+    op_end(FS_OP_FILE_CLOSE, &t);
+    return ret;
 }
 
 int Dir_Create(char* path)
 {
+    if (remote_fd >= 0) return remote_path(FS_REQ_DIR_CREATE, path);
     dprintf("Dir_Create('%s'):\n", path);
-    return create_file_or_directory(1, path);
+    if (journal_make_room() < 0) return -1;
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_wrlock(&ns_lock);
+    int ret = create_file_or_directory(1, path);
+    pthread_rwlock_unlock(&ns_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    journal_maybe_commit();
+    op_end(FS_OP_DIR_CREATE, &t);
+    return ret;
 }
 
-int Dir_Unlink(char* path)
+static int unlink_dir(char* path)
 {
     if (path == NULL)//Empty path error
     {
@@ -1041,8 +3910,9 @@ int Dir_Unlink(char* path)
         return -1;
     }
     int child_inode;
+    char last_fname[MAX_NAME];
     //Getting the parent_inode and child_inode
-    int parent_inode = follow_path(path, &child_inode, NULL);
+    int parent_inode = follow_path(path, &child_inode, last_fname);
     if (parent_inode < 0)//Directory not found
     {
         osErrno = E_NO_SUCH_DIR;
@@ -1055,11 +3925,27 @@ int Dir_Unlink(char* path)
     }
     //Remove_inode() function takes care of -1 general error, -2 directory is not
     //empty and -3 wrong type. It return 0 in a succesful case
-    int remove = remove_inode(1, parent_inode, child_inode);
+    int remove = remove_inode(1, parent_inode, child_inode, last_fname);
     return remove;
 }
 
-int Dir_Size(char* path)
+int Dir_Unlink(char* path)
+{
+    if (remote_fd >= 0) return remote_path(FS_REQ_DIR_UNLINK, path);
+    if (journal_make_room() < 0) return -1;
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_wrlock(&ns_lock);
+    int ret = unlink_dir(path);
+    pthread_rwlock_unlock(&ns_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    journal_maybe_commit();
+    op_end(FS_OP_DIR_UNLINK, &t);
+    return ret;
+}
+
+static int dir_size(char* path)
 {
     if (path == NULL)//Empty path error
     {
@@ -1076,7 +3962,7 @@ int Dir_Size(char* path)
     // load the disk sector containing the child inode
     int inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
     char inode_buffer[SECTOR_SIZE];
-    if (Disk_Read(inode_sector, inode_buffer) < 0)
+    if (cache_read(inode_sector, inode_buffer) < 0)
     {
         osErrno = E_GENERAL;
         return -1;
@@ -1095,7 +3981,21 @@ int Dir_Size(char* path)
     return (child->size * sizeof(dirent_t));
 }
 
-int Dir_Read(char* path, void* buffer, int size)
+int Dir_Size(char* path)
+{
+    if (remote_fd >= 0) return remote_path(FS_REQ_DIR_SIZE, path);
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_rdlock(&ns_lock);
+    int ret = dir_size(path);
+    pthread_rwlock_unlock(&ns_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    op_end(FS_OP_DIR_SIZE, &t);
+    return ret;
+}
+
+static int read_dir(char* path, void* buffer, int size)
 {
     if (path == NULL)//Empty path error
     {
@@ -1112,7 +4012,7 @@ int Dir_Read(char* path, void* buffer, int size)
     // load the disk sector containing the child inode
     int inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
     char inode_buffer[SECTOR_SIZE];
-    if (Disk_Read(inode_sector, inode_buffer) < 0)
+    if (cache_read(inode_sector, inode_buffer) < 0)
     {
         osErrno = E_GENERAL;
         return -1;
@@ -1138,7 +4038,12 @@ int Dir_Read(char* path, void* buffer, int size)
     while(entries > 0)
     {
         char inode_buffer[SECTOR_SIZE];
-        Disk_Read(child->data[i], inode_buffer);
+        int sector = map_block(child, i, NULL);
+        if (sector < 0 || cache_read(sector, inode_buffer) < 0)
+        {
+            osErrno = E_GENERAL;
+            return -1;
+        }
         int copy = DIRENTS_PER_SECTOR;
         if (DIRENTS_PER_SECTOR > entries)
         {
@@ -1153,3 +4058,291 @@ int Dir_Read(char* path, void* buffer, int size)
     return child->size;
 }
 
+int Dir_Read(char* path, void* buffer, int size)
+{
+    if (remote_fd >= 0) {
+        if (!path || size < 0) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        return remote_call(FS_REQ_DIR_READ, size, 0, 0, path, strlen(path) + 1, buffer, size);
+    }
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_rdlock(&ns_lock);
+    int ret = read_dir(path, buffer, size);
+    pthread_rwlock_unlock(&ns_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    op_end(FS_OP_DIR_READ, &t);
+    return ret;
+}
+
+// a child to look up in the inode table, and where it goes in the
+// entries returned
+typedef struct _child {
+    int inode;
+    int index;
+} child_t;
+
+static int cmp_child(const void* a, const void* b)
+{
+    return ((child_t*)a)->inode - ((child_t*)b)->inode;
+}
+
+static int read_dir_plus(char* path, FS_DirEntry_t* entries, int count)
+{
+    dprintf("Dir_ReadPlus('%s',count=%d):\n", path, count);
+    if (path == NULL || entries == NULL)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    int dir_inode = -1;
+    follow_path(path, &dir_inode, NULL);
+    if (dir_inode < 0)
+    {
+        osErrno = E_NO_SUCH_DIR;
+        return -1;
+    }
+    char inode_buffer[SECTOR_SIZE];
+    int inode_sector = INODE_TABLE_START_SECTOR + dir_inode / INODES_PER_SECTOR;
+    if (cache_read(inode_sector, inode_buffer) < 0)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    inode_t dir;
+    memcpy(&dir, inode_buffer + (dir_inode % INODES_PER_SECTOR) * sizeof(inode_t), sizeof(inode_t));
+    if (dir.type != 1)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    int n = dir.size;
+    if (n > count)
+    {
+        osErrno = E_BUFFER_TOO_SMALL;
+        return -1;
+    }
+    if (n == 0) return 0;
+    child_t* children = malloc(n * sizeof(child_t));
+    if (!children)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    // copy the directory entries one data block at a time
+    char buf[SECTOR_SIZE];
+    for (int i = 0; i < n; i++) {
+        if (i % DIRENTS_PER_SECTOR == 0) {
+            int sector = map_block(&dir, i / DIRENTS_PER_SECTOR, NULL);
+            if (sector < 0 || cache_read(sector, buf) < 0) {
+                free(children);
+                osErrno = E_GENERAL;
+                return -1;
+            }
+        }
+        dirent_t* d = (dirent_t*)buf + i % DIRENTS_PER_SECTOR;
+        memcpy(entries[i].name, d->fname, sizeof(entries[i].name));
+        entries[i].inode = d->inode;
+        children[i].inode = d->inode;
+        children[i].index = i;
+    }
+
+    // look the children up in the order of their inodes, so that each
+    // sector of the inode table is read once for all the children in it
+    qsort(children, n, sizeof(child_t), cmp_child);
+    int loaded = -1;
+    for (int i = 0; i < n; i++) {
+        int inode = children[i].inode;
+        int sector = INODE_TABLE_START_SECTOR + inode / INODES_PER_SECTOR;
+        if (sector != loaded) {
+            if (cache_read(sector, inode_buffer) < 0) {
+                free(children);
+                osErrno = E_GENERAL;
+                return -1;
+            }
+            loaded = sector;
+        }
+        inode_t* child = (inode_t*)(inode_buffer + (inode % INODES_PER_SECTOR) * sizeof(inode_t));
+        FS_DirEntry_t* e = &entries[children[i].index];
+        e->type = child->type;
+        if (child->type == 1) e->size = child->size * sizeof(dirent_t);
+        else {
+            // the size of an open file is the one in memory (which
+            // includes the data not yet written)
+            pthread_rwlock_rdlock(&inode_locks[inode]);
+            pthread_mutex_lock(&fd_lock);
+            e->size = open_count[inode] ? open_file_size(inode) : child->size;
+            pthread_mutex_unlock(&fd_lock);
+            pthread_rwlock_unlock(&inode_locks[inode]);
+        }
+    }
+    free(children);
+    return n;
+}
+
+int Dir_ReadPlus(char* path, FS_DirEntry_t* entries, int count)
+{
+    if (remote_fd >= 0) {
+        if (!path || count < 0) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        return remote_call(FS_REQ_DIR_READPLUS, count, 0, 0, path, strlen(path) + 1,
+            entries, count * sizeof(FS_DirEntry_t));
+    }
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_rdlock(&ns_lock);
+    int ret = read_dir_plus(path, entries, count);
+    pthread_rwlock_unlock(&ns_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    op_end(FS_OP_DIR_READPLUS, &t);
+    return ret;
+}
+
+static int open_dir(char* path)
+{
+    dprintf("Dir_Open('%s'):\n", path);
+    if (path == NULL)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    int child_inode = -1;
+    follow_path(path, &child_inode, NULL);
+    if (child_inode < 0)
+    {
+        osErrno = E_NO_SUCH_DIR;
+        return -1;
+    }
+    char inode_buffer[SECTOR_SIZE];
+    int inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
+    if (cache_read(inode_sector, inode_buffer) < 0)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    inode_t* child = (inode_t*)(inode_buffer + (child_inode % INODES_PER_SECTOR) * sizeof(inode_t));
+    if (child->type != 1)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&fd_lock);
+    int dd = open_dirs_free;
+    if (dd >= 0) {
+        open_dirs_free = open_dirs[dd].next;
+        open_dirs[dd].inode = child_inode;
+        open_dirs[dd].pos = 0;
+    }
+    pthread_mutex_unlock(&fd_lock);
+    if (dd < 0)
+    {
+        dprintf("... max open directories reached\n");
+        osErrno = E_TOO_MANY_OPEN_FILES;
+        return -1;
+    }
+    return dd;
+}
+
+int Dir_Open(char* path)
+{
+    if (remote_fd >= 0) return remote_path(FS_REQ_DIR_OPEN, path);
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_rdlock(&ns_lock);
+    int ret = open_dir(path);
+    pthread_rwlock_unlock(&ns_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    op_end(FS_OP_DIR_OPEN, &t);
+    return ret;
+}
+
+// check that 'dd' is an open directory; return 0 if OK, and -1 (with
+// osErrno set) if not
+static int check_open_dir(int dd)
+{
+    if (0 > dd || dd >= MAX_OPEN_DIRS || open_dirs[dd].inode < 0) {
+        dprintf("... dd=%d not an open directory\n", dd);
+        osErrno = E_BAD_FD;
+        return -1;
+    }
+    return 0;
+}
+
+// the data block with the next entry is read every time, as the
+// directory may have changed since the last entry was returned; the
+// caller holds the directory's inode lock shared
+static int next_dirent(int dd, char* name, int* inode)
+{
+    open_dir_t* od = &open_dirs[dd];
+    char inode_buffer[SECTOR_SIZE];
+    int inode_sector = INODE_TABLE_START_SECTOR + od->inode / INODES_PER_SECTOR;
+    if (cache_read(inode_sector, inode_buffer) < 0)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    inode_t* dir = (inode_t*)(inode_buffer + (od->inode % INODES_PER_SECTOR) * sizeof(inode_t));
+    if (od->pos >= dir->size) return 0; // no more entries
+    char buffer[SECTOR_SIZE];
+    int sector = map_block(dir, od->pos / DIRENTS_PER_SECTOR, NULL);
+    if (sector < 0 || cache_read(sector, buffer) < 0)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    dirent_t* d = (dirent_t*)buffer + od->pos % DIRENTS_PER_SECTOR;
+    if (name) {
+        memcpy(name, d->fname, MAX_NAME);
+        name[MAX_NAME - 1] = '\0';
+    }
+    if (inode) *inode = d->inode;
+    od->pos++;
+    return 1;
+}
+
+int Dir_Next(int dd, char* name, int* inode)
+{
+    if (remote_fd >= 0) return remote_dir_next(dd, name, inode);
+    op_timer_t t;
+    op_begin(&t);
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_rdlock(&ns_lock);
+    int ret = check_open_dir(dd);
+    if (ret == 0) {
+        int dir = open_dirs[dd].inode;
+        pthread_rwlock_rdlock(&inode_locks[dir]);
+        ret = next_dirent(dd, name, inode);
+        pthread_rwlock_unlock(&inode_locks[dir]);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    op_end(FS_OP_DIR_NEXT, &t);
+    return ret;
+}
+
+int Dir_Close(int dd)
+{
+    if (remote_fd >= 0) return remote_call(FS_REQ_DIR_CLOSE, dd, 0, 0, NULL, 0, NULL, 0);
+    dprintf("Dir_Close(%d):\n", dd);
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&fd_lock);
+    int ret = check_open_dir(dd);
+    if (ret == 0) {
+        open_dirs[dd].inode = -1;
+        open_dirs[dd].next = open_dirs_free;
+        open_dirs_free = dd;
+    }
+    pthread_mutex_unlock(&fd_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
@@ -5,6 +5,8 @@
 #ifndef __LibFS_h__
 #define __LibFS_h__
 
+#include <sys/uio.h>
+
 // error types
 typedef enum {
     E_GENERAL,      // general
@@ -22,39 +24,203 @@ typedef enum {
     E_BUFFER_TOO_SMALL, 
 } FS_Error_t;
     
-// used for errors
-extern int osErrno;
+// used for errors (each thread has its own)
+extern __thread int osErrno;
 
 // a few file system parameters
 
 // the total number of files and directories in the file system has a
-// maximum limit of 1000
-#define MAX_FILES 1000
-
-// each file can have a maximum of 30 sectors; we treat the data
-// blocks of the file/director the same as sectors
-#define MAX_SECTORS_PER_FILE 30
+// maximum limit, chosen when the file system is formatted (1000 for a
+// file system created by FS_Boot)
+#define DEFAULT_MAX_FILES 1000
 
-// the size of a file or directory is limited
-#define MAX_FILE_SIZE (MAX_SECTORS_PER_FILE*SECTOR_SIZE)
+// the data blocks of a file/directory are kept in at most 1 + sector
+// size / 8 extents (65 with 512-byte sectors; an extent is a run of
+// consecutive sectors, as we treat the data blocks of the
+// file/directory the same as sectors); the size of a file or
+// directory is thus limited only by the free space and how
+// fragmented it is; a file of at most 16 bytes takes no data blocks,
+// its data is kept in its inode
 
-// file system generic calls
+// file system generic calls; FS_Boot() creates a file system with the
+// default geometry if the file doesn't exist, while FS_Format() always
+// creates one (overwriting the file) with 'total_sectors' sectors of
+// 'sector_size' bytes and room for 'max_files' files and directories,
+// and boots it
 int FS_Boot(char *path);
+int FS_Format(char *path, int sector_size, int total_sectors, int max_files);
 int FS_Sync();
+int FS_CacheStats(int *hits, int *misses);
+
+// statistics, always collected: for each API entry point, the number
+// of calls, the disk reads and writes they made (the calls to
+// Disk_Read/Disk_ReadSectors and Disk_Write/Disk_WriteSectors), and a
+// histogram of their latency, where bucket i counts the calls taking
+// less than 2^i microseconds (and at least 2^(i-1)), and the last
+// bucket all slower ones; all reads (File_Read, File_PRead and
+// File_ReadV) count as FS_OP_FILE_READ, and all writes as
+// FS_OP_FILE_WRITE
+typedef enum {
+    FS_OP_BOOT,
+    FS_OP_SYNC,
+    FS_OP_FILE_CREATE,
+    FS_OP_FILE_OPEN,
+    FS_OP_FILE_READ,
+    FS_OP_FILE_WRITE,
+    FS_OP_FILE_CLOSE,
+    FS_OP_FILE_UNLINK,
+    FS_OP_DIR_CREATE,
+    FS_OP_DIR_UNLINK,
+    FS_OP_DIR_SIZE,
+    FS_OP_DIR_READ,
+    FS_OP_DIR_OPEN,
+    FS_OP_DIR_NEXT,
+    FS_OP_DIR_READPLUS,
+    FS_OP_FILE_READVIEW,
+    FS_OP_CHECK,
+    FS_OP_SNAPSHOT,
+    FS_OPS
+} FS_Op_t;
+
+#define FS_LATENCY_BUCKETS 24
+
+typedef struct {
+    unsigned long calls;
+    unsigned long disk_reads;
+    unsigned long disk_writes;
+    unsigned long latency[FS_LATENCY_BUCKETS];
+} FS_OpStats_t;
+
+// the statistics since the library was loaded (the cache hits and
+// misses are since the file system was booted, as in FS_CacheStats)
+typedef struct {
+    FS_OpStats_t op[FS_OPS];
+    unsigned long path_lookups;       // the paths followed
+    unsigned long path_components;    // the names looked up in them
+    unsigned long dcache_hits;        // the names found in the dentry cache
+    unsigned long dirent_lookups;     // the names looked up in a directory
+    unsigned long dirents_compared;   // the directory entries compared
+    unsigned long allocations;        // the inodes and runs of sectors allocated
+    unsigned long bitmap_sectors_scanned; // the bitmap sectors searched for them
+    unsigned long cache_hits;         // the sector cache hits
+    unsigned long cache_misses;       // and misses
+} FS_Stats_t;
+
+int FS_GetStats(FS_Stats_t *stats);
+
+// FS_Check() synchronizes the file system and checks it: every inode
+// in use, the sectors they use against the sector bitmap, and the
+// directory entries against the inode bitmap; it returns the number
+// of problems found (0 if none), which are counted in 'found'
+typedef struct {
+    int inodes;        // the files and directories in use
+    int blocks;        // the sectors they use (with indirect and index sectors)
+    int bad_inodes;    // the inodes with a bad type, size or extents
+    int dup_blocks;    // the sectors used more than once
+    int lost_blocks;   // the sectors in use but free in the sector bitmap
+    int leaked_blocks; // the sectors not in use but taken in the sector bitmap
+    int bad_entries;   // the directory entries with a bad name or inode
+    int orphans;       // the inodes in use but in no directory
+    int extra_links;   // the inodes in more than one directory
+} FS_Check_t;
+
+int FS_Check(FS_Check_t *found);
+
+// FS_Snapshot() synchronizes the file system and takes a snapshot of
+// it (which costs next to nothing), then saves the snapshot to the
+// given file (a disk file that can be booted) in the background, while
+// the file system goes on being used; it returns the number of the
+// snapshot, and FS_SnapshotWait() waits until it's saved (which must
+// be done, even if it isn't needed), and returns 0 if it was saved
+int FS_Snapshot(char *file);
+int FS_SnapshotWait(int snapshot);
+
+// batched operations: the changes made between FS_BeginBatch() and
+// FS_CommitBatch() are written back together when the batch is
+// committed (which syncs the file system), unless they don't fit in
+// the cache, in which case they're committed in parts as it fills up;
+// File_CreateMany() and File_UnlinkMany() run in one batch, store the
+// result of each path (0 or the error code) in 'results', and return
+// the number of successful ones
+int FS_BeginBatch();
+int FS_CommitBatch();
 
 // file ops
 int File_Create(char *file);
 int File_Open(char *file);
 int File_Read(int fd, void *buffer, int size);
 int File_Write(int fd, void *buffer, int size);
+int File_PRead(int fd, void *buffer, int size, int offset);
+int File_PWrite(int fd, void *buffer, int size, int offset);
+int File_ReadV(int fd, struct iovec *iov, int iovcnt, int offset);
+int File_WriteV(int fd, struct iovec *iov, int iovcnt, int offset);
 int File_Seek(int fd, int offset);
 int File_Close(int fd);
 int File_Unlink(char *file);
+int File_CreateMany(char **paths, int n, int *results);
+int File_UnlinkMany(char **paths, int n, int *results);
+
+// zero-copy reads: File_ReadView() points the view at up to 'size'
+// bytes of the file starting from 'offset' (straight in the disk, or
+// in the inode of a small file, in one or more pieces) and returns
+// the number of bytes in the view (0 at the end of file); the data
+// must not be changed, and it stays put until the view (even an empty
+// one) is given back with File_ReleaseView(); in between the file
+// can't be written, nor the file system synchronized, checked,
+// snapshotted or booted, nor a batch begun or committed: other threads
+// doing any of that wait until the view is given back, and the thread
+// holding the view mustn't do it itself (nor close the file); it may
+// read, create, write and remove other files and directories, but as
+// nothing is committed until the view is given back, once the cache
+// is full of these changes the operations changing more fail
+typedef struct {
+    struct iovec *iov; // the pieces of the data
+    int iovcnt;        // the number of pieces
+    int inode;         // the file (used by the file system)
+} FS_View_t;
+
+int File_ReadView(int fd, int offset, int size, FS_View_t *view);
+int File_ReleaseView(FS_View_t *view);
 
 // directory ops
 int Dir_Create(char *path);
 int Dir_Unlink(char *path);
 int Dir_Size(char *path);
+
+// Dir_Read() stores the entries of the directory in the buffer, each
+// as an FS_Dirent_t (so Dir_Size() gives the size they need)
+typedef struct {
+    char name[16]; // including the ending null
+    int inode;
+} FS_Dirent_t;
+
 int Dir_Read(char *path, void *buffer, int size);
 
+// Dir_ReadPlus() returns the entries of the directory (up to 'count',
+// else it fails with E_BUFFER_TOO_SMALL) along with the type (0 for a
+// file, 1 for a directory) and size (in bytes, as given by Dir_Size()
+// for a directory) of each, and returns the number of entries
+typedef struct {
+    char name[16];
+    int inode;
+    int type;
+    int size;
+} FS_DirEntry_t;
+
+int Dir_ReadPlus(char *path, FS_DirEntry_t *entries, int count);
+
+// directory streams: Dir_Open() returns a descriptor for reading the
+// entries of the directory one at a time; Dir_Next() stores the name
+// (up to 16 bytes, including the ending null) and the inode of the
+// next entry, and returns 1, or 0 once there are no more entries;
+// each entry is read (through the cache) from the directory as it is
+// at that call, so the directory is never looked up again and the
+// memory used doesn't depend on its size; an entry created while the
+// directory is read may or may not be returned, and one removed may
+// make another one be skipped (the last entry takes the place of the
+// removed one)
+int Dir_Open(char *path);
+int Dir_Next(int dd, char *name, int *inode);
+int Dir_Close(int dd);
+
 #endif /* __LibFS_h__ */
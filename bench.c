@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "LibFS.h"
+
+// micro-benchmarks of the file system hot paths; each one prints a
+// line of JSON with the number of operations, the throughput, and the
+// median and 99th percentile latency (in microseconds)
+
+#define SECTOR 4096       // the sector size of the disk benchmarked
+#define SECTORS 16384     // the number of sectors (64 MB)
+#define FILES 12000       // the number of inodes
+#define DIR_FILES 10000   // the number of files in the large directory
+#define IO_SIZE 4096      // the size of each read and write
+#define IO_FILE (8 << 20) // the size of the file read and written
+
+static char *diskfile;
+static double *lat; // the latency of each operation (in seconds)
+static int nlat;
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk]\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fail(char *what)
+{
+  printf("ERROR: %s failed (osErrno=%d)\n", what, osErrno);
+  exit(-1);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(double *)a, y = *(double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// start timing a batch of operations
+static void begin()
+{
+  nlat = 0;
+}
+
+// record the latency of one operation started at 't'
+static void record(double t)
+{
+  lat[nlat++] = now() - t;
+}
+
+// print the results of the batch
+static void report(char *name)
+{
+  double total = 0;
+  for(int i = 0; i < nlat; i++) total += lat[i];
+  qsort(lat, nlat, sizeof(double), cmp_double);
+  printf("{\"bench\": \"%s\", \"ops\": %d, \"ops_per_sec\": %.0f, "
+	 "\"p50_us\": %.2f, \"p99_us\": %.2f}\n", name, nlat,
+	 total > 0 ? nlat / total : 0, lat[nlat / 2] * 1e6, lat[nlat * 99 / 100] * 1e6);
+  fflush(stdout);
+}
+
+static void bench_create()
+{
+  char path[64];
+  if(Dir_Create("/big") < 0) fail("Dir_Create");
+  begin();
+  for(int i = 0; i < DIR_FILES; i++) {
+    sprintf(path, "/big/f%d", i);
+    double t = now();
+    if(File_Create(path) < 0) fail("File_Create");
+    record(t);
+  }
+  report("file_create");
+}
+
+static void bench_open(int depth)
+{
+  char path[256], name[64];
+  strcpy(path, "");
+  for(int i = 0; i < depth - 1; i++) {
+    sprintf(name, "/d%d", i);
+    strcat(path, name);
+    Dir_Create(path); // may exist from a shallower run
+  }
+  strcat(path, "/file");
+  if(File_Create(path) < 0) fail("File_Create");
+  begin();
+  for(int i = 0; i < 10000; i++) {
+    double t = now();
+    int fd = File_Open(path);
+    if(fd < 0) fail("File_Open");
+    record(t);
+    File_Close(fd);
+  }
+  sprintf(name, "file_open_depth%d", depth);
+  report(name);
+}
+
+static void bench_io(char *buf)
+{
+  if(File_Create("/io") < 0) fail("File_Create");
+  int fd = File_Open("/io");
+  if(fd < 0) fail("File_Open");
+  int n = IO_FILE / IO_SIZE;
+
+  begin();
+  for(int i = 0; i < n; i++) {
+    double t = now();
+    if(File_Write(fd, buf, IO_SIZE) != IO_SIZE) fail("File_Write");
+    record(t);
+  }
+  report("file_write_seq");
+
+  File_Seek(fd, 0);
+  begin();
+  for(int i = 0; i < n; i++) {
+    double t = now();
+    if(File_Read(fd, buf, IO_SIZE) != IO_SIZE) fail("File_Read");
+    record(t);
+  }
+  report("file_read_seq");
+
+  srand(1);
+  begin();
+  for(int i = 0; i < n; i++) {
+    int off = (rand() % n) * IO_SIZE;
+    double t = now();
+    if(File_PRead(fd, buf, IO_SIZE, off) != IO_SIZE) fail("File_PRead");
+    record(t);
+  }
+  report("file_read_rand");
+
+  begin();
+  for(int i = 0; i < n; i++) {
+    int off = (rand() % n) * IO_SIZE;
+    double t = now();
+    if(File_PWrite(fd, buf, IO_SIZE, off) != IO_SIZE) fail("File_PWrite");
+    record(t);
+  }
+  report("file_write_rand");
+  File_Close(fd);
+}
+
+static void bench_dir_read()
+{
+  int size = Dir_Size("/big");
+  char *buf = malloc(size);
+  if(size < 0 || !buf) fail("Dir_Size");
+  begin();
+  for(int i = 0; i < 100; i++) {
+    double t = now();
+    if(Dir_Read("/big", buf, size) != DIR_FILES) fail("Dir_Read");
+    record(t);
+  }
+  report("dir_read_large");
+  free(buf);
+}
+
+static void bench_sync_boot()
+{
+  char path[64];
+  begin();
+  for(int i = 0; i < 100; i++) {
+    sprintf(path, "/s%d", i);
+    if(File_Create(path) < 0) fail("File_Create");
+    double t = now();
+    if(FS_Sync() < 0) fail("FS_Sync");
+    record(t);
+  }
+  report("fs_sync");
+
+  begin();
+  for(int i = 0; i < 20; i++) {
+    double t = now();
+    if(FS_Boot(diskfile) < 0) fail("FS_Boot");
+    record(t);
+  }
+  report("fs_boot");
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc > 2) usage(argv[0]);
+  diskfile = (argc == 2) ? argv[1] : "bench-disk";
+  lat = malloc(IO_FILE / IO_SIZE * sizeof(double) + 10000 * sizeof(double));
+  char *buf = malloc(IO_SIZE);
+  if(!lat || !buf) fail("malloc");
+  memset(buf, 'x', IO_SIZE);
+
+  if(FS_Format(diskfile, SECTOR, SECTORS, FILES) < 0) fail("FS_Format");
+  bench_create();
+  bench_open(1);
+  bench_open(4);
+  bench_open(8);
+  bench_io(buf);
+  bench_dir_read();
+  bench_sync_boot();
+  if(FS_Sync() < 0) fail("FS_Sync");
+  return 0;
+}
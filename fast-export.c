@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+// each file is exported in large pieces straight from the disk
+#define VIEWSZ (1 << 20)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s disk dir to_unix_dir [file...]\n", prog);
+  exit(1);
+}
+
+// export the file 'path' to the host file 'fname'; return the number
+// of bytes exported, or -1 if there's error
+static long export(char *path, char *fname)
+{
+  int fd = File_Open(path);
+  if(fd < 0) {
+    printf("ERROR: can't open file '%s'\n", path);
+    return -1;
+  }
+  FILE* fptr = fopen(fname, "w");
+  if(!fptr) {
+    printf("ERROR: can't open file '%s' to export\n", fname);
+    File_Close(fd);
+    return -1;
+  }
+
+  FS_View_t view; long total = 0; int sz;
+  do {
+    sz = File_ReadView(fd, total, VIEWSZ, &view);
+    if(sz < 0) {
+      printf("ERROR: can't read file '%s'\n", path);
+      total = -1;
+      break;
+    }
+    for(int i = 0; i < view.iovcnt && total >= 0; i++) {
+      int len = view.iov[i].iov_len;
+      if((int)fwrite(view.iov[i].iov_base, 1, len, fptr) != len) {
+	printf("ERROR: can't write file '%s'\n", fname);
+	total = -1;
+      }
+    }
+    File_ReleaseView(&view);
+    if(total >= 0) total += sz;
+  } while(sz > 0 && total >= 0);
+
+  if(fclose(fptr) != 0 && total >= 0) {
+    printf("ERROR: can't write file '%s'\n", fname);
+    total = -1;
+  }
+  File_Close(fd);
+  return total;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc < 4) usage(argv[0]);
+  char *diskfile = argv[1], *dir = argv[2], *udir = argv[3];
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  // the files named, or else all the files in the directory
+  int count = argc - 4;
+  FS_DirEntry_t *entries = NULL;
+  if(count == 0) {
+    int sz = Dir_Size(dir);
+    if(sz < 0) {
+      printf("ERROR: can't list '%s'\n", dir);
+      return -2;
+    }
+    int n = sz / sizeof(FS_Dirent_t);
+    entries = malloc(n * sizeof(FS_DirEntry_t) + 1);
+    count = entries ? Dir_ReadPlus(dir, entries, n) : -1;
+    if(count < 0) {
+      printf("ERROR: can't list '%s'\n", dir);
+      return -2;
+    }
+  }
+
+  int files = 0, failed = 0; long bytes = 0;
+  for(int i = 0; i < count; i++) {
+    char *name = entries ? entries[i].name : argv[4 + i];
+    if(entries && entries[i].type != 0) continue; // not a file
+    char path[256], fname[4096];
+    snprintf(path, sizeof(path), "%s/%s", strcmp(dir, "/") ? dir : "", name);
+    snprintf(fname, sizeof(fname), "%s/%s", udir, name);
+    long n = export(path, fname);
+    if(n < 0) failed++;
+    else { files++; bytes += n; }
+  }
+  free(entries);
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  printf("exported %d files (%ld bytes)\n", files, bytes);
+  return failed ? -4 : 0;
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+// the host files are read (and written to the file system) in large
+// chunks, so that the data goes to disk many sectors at a time
+#define BFSZ (1 << 20)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s disk dir from_unix_file...\n", prog);
+  exit(1);
+}
+
+// import the host file 'fname' as the file 'path'; return the number
+// of bytes imported, or -1 if there's error
+static long import(char *path, char *fname, char *buf)
+{
+  FILE* fptr = fopen(fname, "r");
+  if(!fptr) {
+    printf("ERROR: can't open file '%s' to import\n", fname);
+    return -1;
+  }
+  if(File_Create(path) < 0) {
+    printf("ERROR: can't create file '%s'\n", path);
+    fclose(fptr);
+    return -1;
+  }
+  int fd = File_Open(path);
+  if(fd < 0) {
+    printf("ERROR: can't open file '%s'\n", path);
+    fclose(fptr);
+    return -1;
+  }
+
+  long total = 0; int rsz;
+  while((rsz = fread(buf, 1, BFSZ, fptr)) > 0) {
+    if(File_Write(fd, buf, rsz) != rsz) {
+      printf("ERROR: can't write file '%s'\n", path);
+      total = -1;
+      break;
+    }
+    total += rsz;
+  }
+  if(total >= 0 && ferror(fptr)) {
+    printf("ERROR: can't read file '%s' to import\n", fname);
+    total = -1;
+  }
+  fclose(fptr);
+  if(File_Close(fd) < 0) total = -1;
+  return total;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc < 4) usage(argv[0]);
+  char *diskfile = argv[1], *dir = argv[2];
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+  char *buf = malloc(BFSZ);
+  if(!buf) {
+    printf("ERROR: out of memory\n");
+    return -2;
+  }
+
+  // all the files are imported in one batch, which is synced at the end
+  FS_BeginBatch();
+  int files = 0, failed = 0; long bytes = 0;
+  for(int i = 3; i < argc; i++) {
+    char path[256];
+    char *name = strrchr(argv[i], '/');
+    name = name ? name + 1 : argv[i];
+    snprintf(path, sizeof(path), "%s/%s", strcmp(dir, "/") ? dir : "", name);
+    long n = import(path, argv[i], buf);
+    if(n < 0) failed++;
+    else { files++; bytes += n; }
+  }
+  free(buf);
+
+  if(FS_CommitBatch() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  printf("imported %d files (%ld bytes)\n", files, bytes);
+  return failed ? -4 : 0;
+}
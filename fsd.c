@@ -0,0 +1,440 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "LibFS.h"
+#include "FSProto.h"
+
+// the file system daemon: boots the file system once and serves the
+// programs using it (see FSProto.h); each connection is served by a
+// thread of its own
+
+#define INBUF (64 << 10)  // the size of the input buffer of a connection
+
+void usage(char *prog)
+{
+  printf("USAGE: %s disk\n", prog);
+  exit(1);
+}
+
+typedef struct conn {
+  int sock;
+  char in[INBUF];         // the requests received but not yet read
+  int in_start, in_end;
+  int *fds, nfds;         // the files and directories left open
+  int *dds, ndds;
+  int *snaps, nsnaps;     // the snapshots not yet waited for
+  int batches;            // the batches not yet committed
+  char *data, *reply;     // the data of a request and of its reply
+  struct conn *prev, *next; // the other connections served
+} conn_t;
+
+static volatile sig_atomic_t stop;
+
+// snapshots are only saved next to the disk served: the request names
+// a file in the disk's directory, which mustn't be the disk itself (or
+// its socket) and can't lead out of it
+static char *disk_dir, *disk_name;
+
+static char *snapshot_path(char *name)
+{
+  if(!name || !name[0] || name[0] == '.' || strchr(name, '/')) return NULL;
+  if(!strcmp(name, disk_name) || (!strncmp(name, disk_name, strlen(disk_name))
+     && !strcmp(name + strlen(disk_name), FS_SOCKET_SUFFIX))) return NULL;
+  char *file = malloc(strlen(disk_dir) + strlen(name) + 2);
+  if(file) sprintf(file, "%s/%s", disk_dir, name);
+  return file;
+}
+
+// the connections being served, so that stopping can wait for them
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conns_gone = PTHREAD_COND_INITIALIZER;
+static conn_t *conns;
+
+static void add_conn(conn_t *c)
+{
+  pthread_mutex_lock(&conns_lock);
+  c->prev = NULL;
+  c->next = conns;
+  if(conns) conns->prev = c;
+  conns = c;
+  pthread_mutex_unlock(&conns_lock);
+}
+
+static void remove_conn(conn_t *c)
+{
+  pthread_mutex_lock(&conns_lock);
+  if(c->prev) c->prev->next = c->next;
+  else conns = c->next;
+  if(c->next) c->next->prev = c->prev;
+  pthread_cond_broadcast(&conns_gone);
+  pthread_mutex_unlock(&conns_lock);
+}
+
+static void on_signal(int sig)
+{
+  stop = 1;
+}
+
+// read 'len' bytes of the requests; return 0 if successful, -1
+// otherwise
+static int get(conn_t *c, void *buf, int len)
+{
+  while(len > 0) {
+    if(c->in_start == c->in_end) {
+      ssize_t n = recv(c->sock, c->in, INBUF, 0);
+      if(n <= 0) return -1;
+      c->in_start = 0;
+      c->in_end = n;
+    }
+    int n = c->in_end - c->in_start;
+    if(n > len) n = len;
+    memcpy(buf, c->in + c->in_start, n);
+    c->in_start += n;
+    buf = (char *)buf + n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int reply(conn_t *c, int ret, void *data, int len)
+{
+  FS_Reply_t rep;
+  rep.ret = ret;
+  rep.err = ret < 0 ? osErrno : 0;
+  rep.len = (ret < 0 || !data) ? 0 : len;
+
+  // the header and the data are sent in full with as few calls as can be
+  struct iovec iov[2] = { { &rep, sizeof(rep) }, { data, rep.len } };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = rep.len > 0 ? 2 : 1;
+  while(msg.msg_iovlen > 0) {
+    ssize_t n = sendmsg(c->sock, &msg, MSG_NOSIGNAL);
+    if(n < 0) return -1;
+    while(msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+      n -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if(msg.msg_iovlen > 0) {
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+      msg.msg_iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+// remember (or forget) a descriptor left open
+static void track(int **list, int *n, int d, int add)
+{
+  if(add) {
+    int *l = realloc(*list, (*n + 1) * sizeof(int));
+    if(!l) return;
+    *list = l;
+    (*list)[(*n)++] = d;
+    return;
+  }
+  for(int i = 0; i < *n; i++)
+    if((*list)[i] == d) { (*list)[i] = (*list)[--*n]; return; }
+}
+
+// whether the descriptor is in the list (one left open by the connection)
+static int tracked(int *list, int n, int d)
+{
+  for(int i = 0; i < n; i++)
+    if(list[i] == d) return 1;
+  return 0;
+}
+
+// run the paths (each ending with a null) in 'data' through 'op'
+static int many(conn_t *c, int (*op)(char **, int, int *), int n, int len)
+{
+  char **paths = malloc(n * sizeof(char *) + 1);
+  int *results = malloc(n * sizeof(int) + 1);
+  int ret = -1, got = 0;
+  if(paths && results)
+    for(int pos = 0; got < n && pos < len; got++) {
+      paths[got] = c->data + pos;
+      pos += strnlen(c->data + pos, len - pos) + 1;
+    }
+  if(paths && results && got == n && c->data[len - 1] == '\0')
+    ret = op(paths, n, results);
+  else osErrno = E_GENERAL;
+  int r = reply(c, ret, results, n * sizeof(int));
+  free(paths);
+  free(results);
+  return r;
+}
+
+// carry out a request and reply to it; return 0 if successful, -1 if
+// the connection is to be closed
+static int serve(conn_t *c, FS_Request_t *req)
+{
+  int ret, a0 = req->arg[0], a1 = req->arg[1], a2 = req->arg[2];
+  char *path = (req->len > 0 && c->data[req->len - 1] == '\0') ? c->data : NULL;
+
+  // a connection uses only the descriptors it opened itself
+  switch(req->op) {
+  case FS_REQ_FILE_READ:
+  case FS_REQ_FILE_READ_VIEW:
+  case FS_REQ_FILE_WRITE:
+  case FS_REQ_FILE_SEEK:
+  case FS_REQ_FILE_CLOSE:
+    if(!tracked(c->fds, c->nfds, a0)) { osErrno = E_BAD_FD; return reply(c, -1, NULL, 0); }
+    break;
+  case FS_REQ_DIR_NEXT:
+  case FS_REQ_DIR_CLOSE:
+    if(!tracked(c->dds, c->ndds, a0)) { osErrno = E_BAD_FD; return reply(c, -1, NULL, 0); }
+    break;
+  }
+
+  switch(req->op) {
+  case FS_REQ_SYNC:
+    return reply(c, FS_Sync(), NULL, 0);
+  case FS_REQ_BEGIN_BATCH:
+    ret = FS_BeginBatch();
+    if(ret == 0) c->batches++;
+    return reply(c, ret, NULL, 0);
+  case FS_REQ_COMMIT_BATCH:
+    if(c->batches == 0) { osErrno = E_GENERAL; return reply(c, -1, NULL, 0); }
+    c->batches--;
+    return reply(c, FS_CommitBatch(), NULL, 0);
+  case FS_REQ_CACHE_STATS: {
+    int counts[2];
+    ret = FS_CacheStats(&counts[0], &counts[1]);
+    return reply(c, ret, counts, sizeof(counts));
+  }
+  case FS_REQ_GET_STATS: {
+    FS_Stats_t st;
+    ret = FS_GetStats(&st);
+    return reply(c, ret, &st, sizeof(st));
+  }
+  case FS_REQ_CHECK: {
+    FS_Check_t found;
+    ret = FS_Check(&found);
+    return reply(c, ret, &found, sizeof(found));
+  }
+  case FS_REQ_SNAPSHOT: {
+    char *file = snapshot_path(path);
+    if(!file) { osErrno = E_GENERAL; return reply(c, -1, NULL, 0); }
+    ret = FS_Snapshot(file);
+    free(file);
+    if(ret >= 0) track(&c->snaps, &c->nsnaps, ret, 1);
+    return reply(c, ret, NULL, 0);
+  }
+  case FS_REQ_SNAPSHOT_WAIT:
+    // only the connection's own snapshots
+    if(!tracked(c->snaps, c->nsnaps, a0)) { osErrno = E_GENERAL; return reply(c, -1, NULL, 0); }
+    track(&c->snaps, &c->nsnaps, a0, 0);
+    return reply(c, FS_SnapshotWait(a0), NULL, 0);
+  case FS_REQ_FILE_CREATE:
+    return reply(c, File_Create(path), NULL, 0);
+  case FS_REQ_FILE_OPEN:
+    ret = File_Open(path);
+    if(ret >= 0) track(&c->fds, &c->nfds, ret, 1);
+    return reply(c, ret, NULL, 0);
+  case FS_REQ_FILE_READ:
+    if(a1 < 0 || a1 > FS_MAX_DATA) { osErrno = E_GENERAL; return reply(c, -1, NULL, 0); }
+    ret = a2 < 0 ? File_Read(a0, c->reply, a1) : File_PRead(a0, c->reply, a1, a2);
+    return reply(c, ret, c->reply, ret);
+  case FS_REQ_FILE_READ_VIEW: {
+    // the view can't outlive the request: its data is copied into the
+    // reply and it's released at once
+    if(a1 < 0 || a1 > FS_MAX_DATA) { osErrno = E_GENERAL; return reply(c, -1, NULL, 0); }
+    FS_View_t view;
+    ret = File_ReadView(a0, a2, a1, &view);
+    if(ret < 0) return reply(c, -1, NULL, 0);
+    int n = 0;
+    for(int i = 0; i < view.iovcnt; i++) {
+      memcpy(c->reply + n, view.iov[i].iov_base, view.iov[i].iov_len);
+      n += view.iov[i].iov_len;
+    }
+    File_ReleaseView(&view);
+    return reply(c, ret, c->reply, n);
+  }
+  case FS_REQ_FILE_WRITE:
+    ret = a1 < 0 ? File_Write(a0, c->data, req->len) : File_PWrite(a0, c->data, req->len, a1);
+    return reply(c, ret, NULL, 0);
+  case FS_REQ_FILE_SEEK:
+    return reply(c, File_Seek(a0, a1), NULL, 0);
+  case FS_REQ_FILE_CLOSE:
+    ret = File_Close(a0);
+    if(ret == 0) track(&c->fds, &c->nfds, a0, 0);
+    return reply(c, ret, NULL, 0);
+  case FS_REQ_FILE_UNLINK:
+    return reply(c, File_Unlink(path), NULL, 0);
+  case FS_REQ_CREATE_MANY:
+  case FS_REQ_UNLINK_MANY:
+    if(a0 < 0 || a0 > req->len) { osErrno = E_GENERAL; return reply(c, -1, NULL, 0); }
+    return many(c, req->op == FS_REQ_CREATE_MANY ? File_CreateMany : File_UnlinkMany, a0, req->len);
+  case FS_REQ_DIR_CREATE:
+    return reply(c, Dir_Create(path), NULL, 0);
+  case FS_REQ_DIR_UNLINK:
+    return reply(c, Dir_Unlink(path), NULL, 0);
+  case FS_REQ_DIR_SIZE:
+    return reply(c, Dir_Size(path), NULL, 0);
+  case FS_REQ_DIR_READ:
+  case FS_REQ_DIR_READPLUS: {
+    // no more room than the directory needs (the size asked for may
+    // be anything)
+    int sz = Dir_Size(path);
+    if(a0 < 0) osErrno = E_GENERAL;
+    if(sz < 0 || a0 < 0) return reply(c, -1, NULL, 0);
+    int plus = req->op == FS_REQ_DIR_READPLUS;
+    int max = plus ? sz / (int)sizeof(FS_Dirent_t) : sz, len;
+    if(a0 < max) max = a0;
+    char *buf = malloc((plus ? max * sizeof(FS_DirEntry_t) : max) + 1);
+    if(!buf) { osErrno = E_GENERAL; return reply(c, -1, NULL, 0); }
+    ret = plus ? Dir_ReadPlus(path, (FS_DirEntry_t *)buf, max) : Dir_Read(path, buf, max);
+    len = plus ? ret * (int)sizeof(FS_DirEntry_t) : ret * (int)sizeof(FS_Dirent_t);
+    int r = reply(c, ret, buf, len);
+    free(buf);
+    return r;
+  }
+  case FS_REQ_DIR_OPEN:
+    ret = Dir_Open(path);
+    if(ret >= 0) track(&c->dds, &c->ndds, ret, 1);
+    return reply(c, ret, NULL, 0);
+  case FS_REQ_DIR_NEXT: {
+    FS_Dirent_t entry;
+    ret = Dir_Next(a0, entry.name, &entry.inode);
+    return reply(c, ret, &entry, ret > 0 ? sizeof(entry) : 0);
+  }
+  case FS_REQ_DIR_CLOSE:
+    ret = Dir_Close(a0);
+    if(ret == 0) track(&c->dds, &c->ndds, a0, 0);
+    return reply(c, ret, NULL, 0);
+  default:
+    printf("ERROR: unknown request %d\n", req->op);
+    return -1;
+  }
+}
+
+static void *client(void *arg)
+{
+  conn_t *c = arg;
+  FS_Request_t req;
+  while(get(c, &req, sizeof(req)) == 0) {
+    if(req.len < 0 || req.len > FS_MAX_DATA || get(c, c->data, req.len) < 0) break;
+    if(serve(c, &req) < 0) break;
+  }
+
+  // whatever the client left open is closed, and its batches committed
+  for(int i = 0; i < c->nfds; i++) File_Close(c->fds[i]);
+  for(int i = 0; i < c->ndds; i++) Dir_Close(c->dds[i]);
+  for(int i = 0; i < c->nsnaps; i++) FS_SnapshotWait(c->snaps[i]);
+  while(c->batches-- > 0) FS_CommitBatch();
+  remove_conn(c);
+  close(c->sock);
+  free(c->fds);
+  free(c->dds);
+  free(c->snaps);
+  free(c->data);
+  free(c->reply);
+  free(c);
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  char *diskfile = argv[1];
+  char *slash = strrchr(diskfile, '/');
+  disk_dir = slash ? strndup(diskfile, slash == diskfile ? 1 : slash - diskfile) : ".";
+  disk_name = slash ? slash + 1 : diskfile;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(diskfile) + strlen(FS_SOCKET_SUFFIX) >= sizeof(addr.sun_path)) {
+    printf("ERROR: disk file name '%s' too long\n", diskfile);
+    return -1;
+  }
+  sprintf(addr.sun_path, "%s%s", diskfile, FS_SOCKET_SUFFIX);
+
+  // a socket left behind by a daemon no longer running is removed
+  // (the file system can't be booted while there's one running)
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    printf("ERROR: disk '%s' is already served\n", diskfile);
+    return -1;
+  }
+  close(sock);
+  unlink(addr.sun_path);
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0) {
+    printf("ERROR: can't listen on '%s'\n", addr.sun_path);
+    return -2;
+  }
+
+  // the signals stopping the daemon are taken only by this thread,
+  // which syncs the file system before leaving
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigset_t stops, old;
+  sigemptyset(&stops);
+  sigaddset(&stops, SIGINT);
+  sigaddset(&stops, SIGTERM);
+
+  printf("serving '%s' on '%s'\n", diskfile, addr.sun_path);
+  fflush(stdout);
+  while(!stop) {
+    int s = accept(sock, NULL, NULL);
+    if(s < 0) {
+      if(errno == EINTR) continue;
+      printf("ERROR: can't accept connection\n");
+      break;
+    }
+    conn_t *c = calloc(1, sizeof(conn_t));
+    if(c) {
+      c->data = malloc(FS_MAX_DATA);
+      c->reply = malloc(FS_MAX_DATA);
+    }
+    if(c) c->sock = s;
+    pthread_t t;
+    int ok = c && c->data && c->reply;
+    if(ok) add_conn(c);
+    pthread_sigmask(SIG_BLOCK, &stops, &old);
+    ok = ok && pthread_create(&t, NULL, client, c) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(!ok) {
+      printf("ERROR: can't serve connection\n");
+      if(c && c->data && c->reply) remove_conn(c);
+      close(s);
+      if(c) { free(c->data); free(c->reply); free(c); }
+      continue;
+    }
+    pthread_detach(t);
+  }
+
+  // no more connections are taken, and the ones served are cut off;
+  // each closes what its client left open before the file system is
+  // synced
+  close(sock);
+  unlink(addr.sun_path);
+  pthread_mutex_lock(&conns_lock);
+  for(conn_t *c = conns; c; c = c->next) shutdown(c->sock, SHUT_RDWR);
+  while(conns) pthread_cond_wait(&conns_gone, &conns_lock);
+  pthread_mutex_unlock(&conns_lock);
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
@@ -3,7 +3,7 @@
 #include <string.h>
 #include "LibFS.h"
 
-#define BFSZ 256
+#define VIEWSZ (1 << 20)
 
 void usage(char *prog)
 {
@@ -35,19 +35,24 @@ int main(int argc, char *argv[])
     return -3;
   }
 
-  char buf[BFSZ]; int sz;
+  // the data is written out straight from the disk
+  FS_View_t view; int sz, off = 0;
   do {
-    sz = File_Read(fd, buf, BFSZ);
+    sz = File_ReadView(fd, off, VIEWSZ, &view);
     if(sz < 0) {
       printf("ERROR: can't read file '%s'\n", path);
       return -4;
-    } else if(sz > 0) {
-      int wsz = fwrite(buf, 1, sz, fptr);
-      if(wsz != sz) {
+    }
+    for(int i = 0; i < view.iovcnt; i++) {
+      int len = view.iov[i].iov_len;
+      int wsz = fwrite(view.iov[i].iov_base, 1, len, fptr);
+      if(wsz != len) {
 	printf("ERROR: can't write file '%s'\n", fname);
 	return -5;
       }
     }
+    File_ReleaseView(&view);
+    off += sz;
   } while(sz > 0);
   
   fclose(fptr);
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk";
+  if(argc > 2) usage(argv[0]);
+  if(argc == 2) diskfile = argv[1];
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+  FS_Check_t found;
+  int problems = FS_Check(&found);
+  if(problems < 0) {
+    printf("ERROR: can't check file system in file '%s'\n", diskfile);
+    return -2;
+  }
+
+  printf("%d files and directories, %d sectors in use\n", found.inodes, found.blocks);
+  if(found.bad_inodes) printf("%d bad inodes\n", found.bad_inodes);
+  if(found.dup_blocks) printf("%d sectors used more than once\n", found.dup_blocks);
+  if(found.lost_blocks) printf("%d sectors in use but free in the bitmap\n", found.lost_blocks);
+  if(found.leaked_blocks) printf("%d sectors not in use but taken in the bitmap\n", found.leaked_blocks);
+  if(found.bad_entries) printf("%d bad directory entries\n", found.bad_entries);
+  if(found.orphans) printf("%d files or directories in no directory\n", found.orphans);
+  if(found.extra_links) printf("%d files or directories in more than one directory\n", found.extra_links);
+  printf("%s\n", problems ? "file system has problems" : "file system is clean");
+  return problems ? 1 : 0;
+}
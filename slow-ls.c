@@ -5,44 +5,79 @@
 
 void usage(char *prog)
 {
-  printf("USAGE: %s [disk] dir\n", prog);
+  printf("USAGE: %s [-l] [disk] dir\n", prog);
   exit(1);
 }
 
-int main(int argc, char *argv[])
+// list the directory with the type and size of each entry
+static int list_long(char *path)
 {
-  char *diskfile, *path;
-  if(argc != 2 && argc != 3) usage(argv[0]);
-  if(argc == 3) { diskfile = argv[1]; path = argv[2]; }
-  else { diskfile = "default-disk"; path = argv[1]; }
-
-  if(FS_Boot(diskfile) < 0) {
-    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
-    return -1;
-  }
   int sz = Dir_Size(path);
   if(sz < 0) {
     printf("ERROR: can't list '%s'\n", path);
     return -2;
-  } else if (sz == 0) {
+  } else if(sz == 0) {
     printf("directory '%s': empty\n", path);
     return 0;
   }
-  
-  char* buf = malloc(sz);
-  int entries = Dir_Read(path, buf, sz);
-  if(entries < 0) {
+
+  int count = sz / sizeof(FS_Dirent_t);
+  FS_DirEntry_t *entries = malloc(count * sizeof(FS_DirEntry_t));
+  int n = entries ? Dir_ReadPlus(path, entries, count) : -1;
+  if(n < 0) {
+    printf("ERROR: can't list '%s'\n", path);
+    return -3;
+  }
+
+  printf("directory '%s':\n     %-15s\t%-s\t%-s\t%-s\n", path, "NAME", "INODE", "TYPE", "SIZE");
+  for(int i = 0; i < n; i++)
+    printf("%-4d %-15s\t%-d\t%-s\t%-d\n", i, entries[i].name, entries[i].inode,
+	   entries[i].type ? "dir" : "file", entries[i].size);
+  free(entries);
+  return 0;
+}
+
+// list the directory one entry at a time
+static int list_short(char *path)
+{
+  int dd = Dir_Open(path);
+  if(dd < 0) {
+    printf("ERROR: can't list '%s'\n", path);
+    return -2;
+  }
+
+  char name[16];
+  int inode, entries = 0, ret;
+  while((ret = Dir_Next(dd, name, &inode)) > 0) {
+    if(entries == 0)
+      printf("directory '%s':\n     %-15s\t%-s\n", path, "NAME", "INODE");
+    printf("%-4d %-15s\t%-d\n", entries++, name, inode);
+  }
+  Dir_Close(dd);
+  if(ret < 0) {
     printf("ERROR: can't list '%s'\n", path);
     return -3;
   }
-  
-  printf("directory '%s':\n     %-15s\t%-s\n", path, "NAME", "INODE");
-  int idx = 0;
-  for(int i=0; i<entries; i++) {
-    printf("%-4d %-15s\t%-d\n", i, &buf[idx], *(int*)&buf[idx+16]);
-    idx += 20;
+  if(entries == 0)
+    printf("directory '%s': empty\n", path);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *path;
+  int longfmt = 0;
+  if(argc > 1 && !strcmp(argv[1], "-l")) { longfmt = 1; argc--; argv++; }
+  if(argc != 2 && argc != 3) usage(argv[0]);
+  if(argc == 3) { diskfile = argv[1]; path = argv[2]; }
+  else { diskfile = "default-disk"; path = argv[1]; }
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
   }
-  free(buf);
+  int ret = longfmt ? list_long(path) : list_short(path);
+  if(ret < 0) return ret;
 
   if(FS_Sync() < 0) {
     printf("ERROR: can't sync disk '%s'\n", diskfile);
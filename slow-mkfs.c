@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s disk sector_size total_sectors [max_files]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 4 && argc != 5) usage(argv[0]);
+  char *diskfile = argv[1];
+  int sector_size = atoi(argv[2]);
+  int total_sectors = atoi(argv[3]);
+  int max_files = (argc == 5) ? atoi(argv[4]) : DEFAULT_MAX_FILES;
+
+  if(FS_Format(diskfile, sector_size, total_sectors, max_files) < 0) {
+    printf("ERROR: can't format file system in file '%s'\n", diskfile);
+    return -1;
+  }
+  printf("file system formatted in '%s' (%d sectors of %d bytes, %d files)\n",
+	 diskfile, total_sectors, sector_size, max_files);
+  return 0;
+}
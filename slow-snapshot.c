@@ -0,0 +1,33 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk] to_unix_file\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *tofile;
+  if(argc == 2) { diskfile = "default-disk"; tofile = argv[1]; }
+  else if(argc == 3) { diskfile = argv[1]; tofile = argv[2]; }
+  else usage(argv[0]);
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+  int snap = FS_Snapshot(tofile);
+  if(snap < 0) {
+    printf("ERROR: can't take snapshot of file system in file '%s'\n", diskfile);
+    return -2;
+  }
+  if(FS_SnapshotWait(snap) < 0) {
+    printf("ERROR: can't save snapshot to file '%s'\n", tofile);
+    return -3;
+  }
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+static char *op_names[FS_OPS] = {
+  "FS_Boot", "FS_Sync", "File_Create", "File_Open", "File_Read",
+  "File_Write", "File_Close", "File_Unlink", "Dir_Create", "Dir_Unlink",
+  "Dir_Size", "Dir_Read", "Dir_Open", "Dir_Next",
+  "Dir_ReadPlus", "File_ReadView", "FS_Check", "FS_Snapshot",
+};
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk] [dir]\n", prog);
+  exit(1);
+}
+
+// list every directory and read every file under the path
+static void walk(char *path)
+{
+  int sz = Dir_Size(path);
+  if(sz < 0) {
+    // not a directory, so it's a file
+    char buf[4096];
+    int fd = File_Open(path);
+    if(fd < 0) return;
+    while(File_Read(fd, buf, sizeof(buf)) > 0);
+    File_Close(fd);
+    return;
+  }
+  if(sz == 0) return;
+
+  FS_Dirent_t *buf = malloc(sz);
+  int entries = Dir_Read(path, buf, sz);
+  for(int i = 0; i < entries; i++) {
+    char child[256];
+    snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") ? path : "", buf[i].name);
+    walk(child);
+  }
+  free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk", *path = "/";
+  if(argc > 3) usage(argv[0]);
+  if(argc >= 2) diskfile = argv[1];
+  if(argc == 3) path = argv[2];
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+  walk(path);
+
+  FS_Stats_t st;
+  if(FS_GetStats(&st) < 0) {
+    printf("ERROR: can't get statistics\n");
+    return -2;
+  }
+  printf("%-12s %8s %10s %10s  latency (calls taking < 2^i us)\n",
+	 "CALL", "CALLS", "READS", "WRITES");
+  for(int i = 0; i < FS_OPS; i++) {
+    FS_OpStats_t *op = &st.op[i];
+    if(op->calls == 0) continue;
+    printf("%-12s %8lu %10lu %10lu ", op_names[i], op->calls, op->disk_reads, op->disk_writes);
+    for(int j = 0; j < FS_LATENCY_BUCKETS; j++)
+      if(op->latency[j]) printf(" %d:%lu", j, op->latency[j]);
+    printf("\n");
+  }
+  printf("path lookups         %lu (%lu names, %lu in the dentry cache)\n",
+	 st.path_lookups, st.path_components, st.dcache_hits);
+  printf("directory lookups    %lu (%lu entries compared)\n",
+	 st.dirent_lookups, st.dirents_compared);
+  printf("allocations          %lu (%lu bitmap sectors scanned)\n",
+	 st.allocations, st.bitmap_sectors_scanned);
+  unsigned long total = st.cache_hits + st.cache_misses;
+  printf("sector cache         %lu hits, %lu misses (%.1f%% hit rate)\n",
+	 st.cache_hits, st.cache_misses, total ? 100.0 * st.cache_hits / total : 0.0);
+  return 0;
+}